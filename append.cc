@@ -0,0 +1,131 @@
+/*** Append mode (-g). Logs and journals only ever grow so if the destination
+     is shorter than the source and the start and end of it match the same
+     parts of the source then it's taken to be an older copy and only the
+     new data on the end is copied. Checking the start catches a log that's
+     been rotated and regrown past its old size. Anything else is copied as
+     normal. ***/
+#include "globals.h"
+
+#define APPEND_CHECK 65536
+
+bool appendMatches(int src_fd, int dest_fd, off_t size);
+
+
+/*** Returns the number of bytes appended or -1 on error ***/
+size_t appendFile(
+	char *src, char *dest, struct stat *src_stat, struct stat *dest_stat)
+{
+	char *buff = bulkBuffer(0);
+	size_t buffsize = job->flags.bulk_io ? BULK_BUFFSIZE : job->buff_size;
+	size_t bytes;
+	off_t offset = dest_stat->st_size;
+	int src_fd;
+	int dest_fd;
+	int wrote;
+	int len;
+
+	if ((src_fd = bulkOpen(src,O_RDONLY,0)) == -1)
+	{
+		logPrintf("ERROR: appendFile(): open(\"%s\"): %s\n",
+			src,strerror(errno));
+		ERROR_EXIT();
+		return -1;
+	}
+	if ((dest_fd = bulkOpen(dest,O_RDWR,0)) == -1)
+	{
+		logPrintf("ERROR: appendFile(): open(\"%s\"): %s\n",
+			dest,strerror(errno));
+		ERROR_EXIT();
+		close(src_fd);
+		return -1;
+	}
+	if (!appendMatches(src_fd,dest_fd,offset))
+	{
+		close(src_fd);
+		close(dest_fd);
+		if (job->stopped) return -1;
+		return copyFile(src,dest,src_stat);
+	}
+	if (lseek(src_fd,offset,SEEK_SET) == -1 ||
+	    lseek(dest_fd,offset,SEEK_SET) == -1)
+	{
+		logPrintf("ERROR: appendFile(): lseek(\"%s\"): %s\n",
+			dest,strerror(errno));
+		ERROR_EXIT();
+		close(src_fd);
+		close(dest_fd);
+		return -1;
+	}
+	if (job->verbose) logPrintf("appending from %s: ",bytesSizeStr(offset));
+	bulkStart(src_fd,dest_fd,src_stat->st_size);
+
+	bytes = 0;
+	wrote = 0;
+	while((len = bulkRead(src_fd,buff,buffsize)) > 0)
+	{
+		if ((wrote = bulkWrite(dest_fd,buff,len)) == -1)
+		{
+			logPrintf("ERROR: appendFile(): write(): %s\n",
+				strerror(errno));
+			ERROR_EXIT();
+			break;
+		}
+		bulkAdvance(src_fd,dest_fd,offset,wrote);
+		offset += wrote;
+		bytes += wrote;
+		job->bytes_done.fetch_add(wrote,memory_order_relaxed);
+	}
+	if (wrote != -1 && len != -1 && !bulkFinish(dest_fd,offset))
+	{
+		logPrintf("ERROR: appendFile(): ftruncate(): %s\n",strerror(errno));
+		ERROR_EXIT();
+		wrote = -1;
+	}
+	close(src_fd);
+	close(dest_fd);
+	if (wrote == -1) return -1;
+
+	if (len == -1)
+	{
+		logPrintf("ERROR: appendFile(): read(): %s\n",strerror(errno));
+		ERROR_EXIT();
+		return -1;
+	}
+	++job->files_copied;
+	++job->files_appended;
+	++job->total_copied;
+	job->bytes_copied += bytes;
+
+	return copyMetaData(src,dest,src_stat,false) ? bytes : -1;
+}
+
+
+
+
+/*** Returns true if the first and last APPEND_CHECK bytes of the
+     destination are the same in the source ***/
+bool appendMatches(int src_fd, int dest_fd, off_t size)
+{
+	char *buff1 = bulkBuffer(0);
+	char *buff2 = bulkBuffer(1);
+	size_t len = min((off_t)APPEND_CHECK,size);
+	ssize_t len1;
+	ssize_t len2;
+	off_t offset;
+
+	for(offset=0;;offset = size - len)
+	{
+		if ((len1 = bulkPread(src_fd,buff1,len,offset)) == -1 ||
+		    (len2 = bulkPread(dest_fd,buff2,len,offset)) == -1)
+		{
+			logPrintf("ERROR: appendMatches(): pread(): %s\n",
+				strerror(errno));
+			ERROR_EXIT();
+			return false;
+		}
+		// Short reads mean something's changed under us
+		if (len1 != (ssize_t)len ||
+		    len2 != (ssize_t)len || memcmp(buff1,buff2,len)) return false;
+		if (offset == size - (off_t)len) return true;
+	}
+}
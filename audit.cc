@@ -0,0 +1,346 @@
+/*** Audit mode (-A). Nothing is copied or changed. Both trees are walked
+     together and every difference is reported on a line of its own
+     starting with what kind it is:
+
+         MISSING  in the source but not the destination
+         EXTRA    in the destination but not the source
+         TYPE     eg a file in one and a directory in the other
+         SIZE     regular files of different sizes
+         CONTENT  same size but different data, or symlink targets differ
+         METADATA mode, owner or mtime differ (not checked with -m)
+
+     Files of the same size are then compared by a pool of threads using
+     large reads. With -N only that percentage of them, picked at random,
+     have their contents compared for a quicker spot check. ***/
+#include "globals.h"
+
+void auditDir(const string &rel_dir, int depth);
+void auditExtra(
+	const string &rel_dir,
+	map<string,struct stat> &src_files, map<string,struct stat> &dest_files);
+void auditMetaData(
+	const string &rel_path, struct stat *src_stat, struct stat *dest_stat);
+void auditLink(const string &rel_path);
+void auditWorker(void);
+int  auditContents(const char *src, const char *dest);
+void auditFinish(void);
+
+
+/*** Audit the whole tree. Sets the exit code to 1 if anything differs. ***/
+void auditTrees(void)
+{
+	struct stat fs;
+
+	if (lstat(job->dir_dest.c_str(),&fs) == -1)
+	{
+		logPrintf("ERROR: auditTrees(): lstat(\"%s\"): %s\n",
+			job->dir_dest.c_str(),strerror(errno));
+		jobStop(1);
+		return;
+	}
+	if (job->audit_sample)
+	{
+		job->audit_seed = (unsigned)time(0) ^ (unsigned)getpid();
+		if (job->verbose)
+		{
+			logPrintf("Comparing the contents of a %d%% sample of files.\n",
+				job->audit_sample);
+		}
+	}
+	auditDir("",1);
+	if (job->stopped) return;
+
+	job->audit_next = 0;
+	if (job->audit_paths.size()) jobTasks(job->threads,auditWorker);
+	if (job->stopped) return;
+
+	auditFinish();
+}
+
+
+
+
+/*** Compare one directory and descend into the sub directories both have.
+     Everything except the contents of same sized files is checked here. ***/
+void auditDir(const string &rel_dir, int depth)
+{
+	map<string,struct stat> src_files;
+	map<string,struct stat> dest_files;
+	map<string,struct stat>::iterator dest_it;
+	string src_dir = job->dir_src + rel_dir;
+	string dest_dir = job->dir_dest + rel_dir;
+	string rel_path;
+	struct stat *dest_stat;
+	mode_t src_type;
+
+	if (!loadDir(src_dir,src_files) || !loadDir(dest_dir,dest_files))
+		return;
+
+	for(auto &[name,src_stat]: src_files)
+	{
+		if (job->stopped) return;
+
+		rel_path = rel_dir + "/" + name;
+		src_type = src_stat.st_mode & S_IFMT;
+
+		switch(src_type)
+		{
+		case S_IFDIR:
+			if (job->dir_rules.size() && dirExcluded(name,rel_path))
+				continue;
+			break;
+		case S_IFREG:
+		case S_IFLNK:
+			if (!nameMatched(name)) continue;
+			break;
+		default:
+			// Nothing else gets copied so don't check it
+			continue;
+		}
+
+		if ((dest_it = findName(name,dest_files)) == dest_files.end())
+		{
+			logReport("MISSING  %s\n",rel_path.c_str());
+			++job->audit_missing;
+			continue;
+		}
+		dest_stat = &dest_it->second;
+		if ((dest_stat->st_mode & S_IFMT) != src_type)
+		{
+			logReport("TYPE     %s\n",rel_path.c_str());
+			++job->audit_type;
+			continue;
+		}
+		auditMetaData(rel_path,&src_stat,dest_stat);
+
+		switch(src_type)
+		{
+		case S_IFDIR:
+			if (job->verbose == VERB_HIGH)
+				logPrintf("%d: Auditing directory \"%s\"\n",depth,rel_path.c_str());
+			auditDir(rel_path,depth+1);
+			break;
+		case S_IFREG:
+			if (src_stat.st_size != dest_stat->st_size)
+			{
+				logReport("SIZE     %s (source %ld, destination %ld)\n",
+					rel_path.c_str(),
+					(long)src_stat.st_size,(long)dest_stat->st_size);
+				++job->audit_size;
+			}
+			else if (!job->audit_sample ||
+			         (int)(rand_r(&job->audit_seed) % 100) < job->audit_sample)
+			{
+				job->audit_paths.push_back(rel_path);
+			}
+			break;
+		case S_IFLNK:
+			auditLink(rel_path);
+		}
+	}
+	auditExtra(rel_dir,src_files,dest_files);
+}
+
+
+
+
+/*** Anything in the destination that the source doesn't have. Excluded
+     directories and names that don't match the patterns don't count. ***/
+void auditExtra(
+	const string &rel_dir,
+	map<string,struct stat> &src_files, map<string,struct stat> &dest_files)
+{
+	string rel_path;
+
+	for(auto &[name,dest_stat]: dest_files)
+	{
+		if (findName(name,src_files) != src_files.end()) continue;
+
+		rel_path = rel_dir + "/" + name;
+		switch(dest_stat.st_mode & S_IFMT)
+		{
+		case S_IFDIR:
+			if (job->dir_rules.size() && dirExcluded(name,rel_path))
+				continue;
+			break;
+		case S_IFREG:
+		case S_IFLNK:
+			if (!nameMatched(name)) continue;
+			break;
+		default:
+			continue;
+		}
+		logReport("EXTRA    %s\n",rel_path.c_str());
+		++job->audit_extra;
+	}
+}
+
+
+
+
+/*** Check what copyFileAttrs() would have set ***/
+void auditMetaData(
+	const string &rel_path, struct stat *src_stat, struct stat *dest_stat)
+{
+	string diffs;
+
+	if (!job->flags.copy_metadata) return;
+
+	if ((diffs = metaDataDiffs(src_stat,dest_stat)).size())
+	{
+		logReport("METADATA %s (%s)\n",rel_path.c_str(),diffs.c_str());
+		++job->audit_metadata;
+	}
+}
+
+
+
+
+void auditLink(const string &rel_path)
+{
+	char src_target[PATH_MAX+1];
+	char dest_target[PATH_MAX+1];
+	string src_path = job->dir_src + rel_path;
+	string dest_path = job->dir_dest + rel_path;
+	ssize_t src_len;
+	ssize_t dest_len;
+
+	if ((src_len = readlink(src_path.c_str(),src_target,PATH_MAX)) == -1 ||
+	    (dest_len = readlink(dest_path.c_str(),dest_target,PATH_MAX)) == -1)
+	{
+		logPrintf("ERROR: auditLink(): readlink(\"%s\"): %s\n",
+			rel_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return;
+	}
+	if (src_len != dest_len || memcmp(src_target,dest_target,src_len))
+	{
+		logReport("CONTENT  %s\n",rel_path.c_str());
+		++job->audit_content;
+	}
+}
+
+
+
+
+/*** Each worker takes the next file to compare until there are none ***/
+void auditWorker(void)
+{
+	string src_path;
+	string dest_path;
+	size_t num;
+
+	while(!job->stopped &&
+	      (num = job->audit_next++) < job->audit_paths.size())
+	{
+		string &rel_path = job->audit_paths[num];
+
+		src_path = job->dir_src + rel_path;
+		dest_path = job->dir_dest + rel_path;
+
+		switch(auditContents(src_path.c_str(),dest_path.c_str()))
+		{
+		case 0:
+			logReport("CONTENT  %s\n",rel_path.c_str());
+			++job->audit_content;
+			// Fall through
+		case 1:
+			++job->files_audited;
+		}
+	}
+}
+
+
+
+
+/*** Returns 1 if the files have the same contents, 0 if not or -1 on
+     error. Unlike sameContents() it always uses the big buffers. ***/
+int auditContents(const char *src, const char *dest)
+{
+	char *buff1 = bulkBuffer(0);
+	char *buff2 = bulkBuffer(1);
+	off_t offset;
+	int ret;
+	int fd1;
+	int fd2;
+	int len1;
+	int len2;
+
+	if ((fd1 = bulkOpen(src,O_RDONLY,0)) == -1)
+	{
+		logPrintf("ERROR: auditContents(): open(\"%s\"): %s\n",
+			src,strerror(errno));
+		ERROR_EXIT();
+		return -1;
+	}
+	if ((fd2 = bulkOpen(dest,O_RDONLY,0)) == -1)
+	{
+		logPrintf("ERROR: auditContents(): open(\"%s\"): %s\n",
+			dest,strerror(errno));
+		ERROR_EXIT();
+		close(fd1);
+		return -1;
+	}
+	bulkStart(fd1,-1,0);
+	bulkStart(fd2,-1,0);
+
+	for(offset=0;;offset += len1)
+	{
+		len1 = bulkRead(fd1,buff1,BULK_BUFFSIZE);
+		len2 = bulkRead(fd2,buff2,BULK_BUFFSIZE);
+		if (len1 == -1 || len2 == -1)
+		{
+			logPrintf("ERROR: auditContents(): read(\"%s\"): %s\n",
+				len1 == -1 ? src : dest,strerror(errno));
+			ERROR_EXIT();
+			ret = -1;
+			break;
+		}
+		if (len1 != len2 || memcmp(buff1,buff2,len1))
+		{
+			ret = 0;
+			break;
+		}
+		if (!len1)
+		{
+			ret = 1;
+			break;
+		}
+		bulkAdvance(fd1,-1,offset,len1);
+		bulkAdvance(fd2,-1,offset,len2);
+		job->bytes_done.fetch_add(len1,memory_order_relaxed);
+	}
+	close(fd1);
+	close(fd2);
+	return ret;
+}
+
+
+
+
+void auditFinish(void)
+{
+	int diffs = job->audit_missing + job->audit_extra + job->audit_type +
+	            job->audit_size + job->audit_content + job->audit_metadata;
+
+	if (diffs)
+	{
+		logReport("Audit found %d difference%s.\n",diffs,diffs == 1 ? "" : "s");
+		if (!job->exit_code) job->exit_code = 1;
+	}
+	else logPuts("Audit found no differences.");
+
+	if (job->verbose)
+	{
+		logPrintf("\nFiles compared      : %d (%s)\n",
+			job->files_audited.load(),bytesSizeStr(job->bytes_done));
+		logPrintf("Missing             : %d\n",job->audit_missing.load());
+		logPrintf("Extra               : %d\n",job->audit_extra.load());
+		logPrintf("Type mismatches     : %d\n",job->audit_type.load());
+		logPrintf("Size mismatches     : %d\n",job->audit_size.load());
+		logPrintf("Content mismatches  : %d\n",job->audit_content.load());
+		logPrintf("Metadata mismatches : %d\n",job->audit_metadata.load());
+		logPrintf("Warnings            : %d\n",job->warnings.load());
+		logPrintf("Errors              : %d\n\n",job->errors.load());
+	}
+}
@@ -0,0 +1 @@
+#define BUILD_DATE "2026-10-19 02:37:44 UTC"
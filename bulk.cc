@@ -0,0 +1,226 @@
+/*** Bulk I/O mode (-k). Reads and writes bypass the page cache with O_DIRECT
+     where the filesystem allows it, otherwise pages are dropped behind the
+     copy so a large sync doesn't evict everything else on the machine.
+     Destinations have their final size preallocated to reduce
+     fragmentation. Only does anything useful on linux, elsewhere its just
+     bigger buffers. ***/
+#include "globals.h"
+
+#define BULK_ALIGN 4096
+
+#ifdef __linux__
+bool clearDirect(int fd);
+#endif
+
+/*** Open with O_DIRECT and, for reading, O_NOATIME. If the filesystem
+     doesn't support the former or we don't own the file for the latter
+     then drop them and try again. ***/
+int bulkOpen(const char *path, int oflags, mode_t mode)
+{
+	if (!job->flags.bulk_io) return open(path,oflags,mode);
+#ifdef __linux__
+	int extra = O_DIRECT;
+	int fd;
+
+	if ((oflags & O_ACCMODE) == O_RDONLY) extra |= O_NOATIME;
+
+	while((fd = open(path,oflags | extra,mode)) == -1)
+	{
+		if (errno == EINVAL && (extra & O_DIRECT))
+			extra &= ~O_DIRECT;
+		else if (errno == EPERM && (extra & O_NOATIME))
+			extra &= ~O_NOATIME;
+		else
+			break;
+	}
+	return fd;
+#else
+	return open(path,oflags,mode);
+#endif
+}
+
+
+
+
+/*** Returns an aligned buffer for this thread big enough for bulk I/O or
+     the job's buffer size, whichever is bigger. Num is 0 or 1 as
+     sameContents() needs two. If an aligned one can't be had an unaligned
+     one will do as O_DIRECT is then just turned off on EINVAL. ***/
+char *bulkBuffer(int num)
+{
+	static thread_local unique_ptr<char,void(*)(void *)> buff[2] = {
+		{ NULL,free },{ NULL,free }
+	};
+	static thread_local size_t buff_size[2];
+	size_t size = max((size_t)BULK_BUFFSIZE,job->buff_size);
+	void *ptr;
+
+	// Round up so O_DIRECT padding always fits
+	size = (size + BULK_ALIGN - 1) & ~(size_t)(BULK_ALIGN - 1);
+	if (size > buff_size[num])
+	{
+		buff[num].reset();
+		buff_size[num] = 0;
+		if (!(ptr = aligned_alloc(BULK_ALIGN,size)) && !(ptr = malloc(size)))
+			throw bad_alloc();
+		buff[num].reset((char *)ptr);
+		buff_size[num] = size;
+	}
+	return buff[num].get();
+}
+
+
+
+
+/*** Tell the kernel we'll be reading sequentially and preallocate the
+     destination. The file size is left alone so an interrupted or failed
+     copy can't look complete to the next run's size check. Preallocation
+     failing doesn't matter. dest_fd can be -1.
+     Sequential readahead is also used without -k if tuning asked for it. ***/
+void bulkStart(int src_fd, int dest_fd, off_t size)
+{
+#ifdef __linux__
+	if (job->flags.bulk_io || job->flags.readahead)
+		posix_fadvise(src_fd,0,0,POSIX_FADV_SEQUENTIAL);
+	if (job->flags.bulk_io && dest_fd != -1 && size)
+		fallocate(dest_fd,FALLOC_FL_KEEP_SIZE,0,size);
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	(void)size;
+#endif
+}
+
+
+
+
+/*** Reads until len or EOF. If O_DIRECT turns out not to work for this
+     file or offset then turn it off and carry on. ***/
+ssize_t bulkRead(int fd, char *buff, size_t len)
+{
+	ssize_t total;
+	ssize_t res;
+
+	for(total=0;total < (ssize_t)len;total += res)
+	{
+		if ((res = read(fd,buff+total,len-total)) == -1)
+		{
+#ifdef __linux__
+			if (errno == EINVAL && clearDirect(fd))
+			{
+				res = 0;
+				continue;
+			}
+#endif
+			return -1;
+		}
+		if (!res) break;
+	}
+	return total;
+}
+
+
+
+
+/*** As above but without moving the file offset ***/
+ssize_t bulkPread(int fd, char *buff, size_t len, off_t offset)
+{
+	ssize_t total;
+	ssize_t res;
+
+	for(total=0;total < (ssize_t)len;total += res)
+	{
+		if ((res = pread(fd,buff+total,len-total,offset+total)) == -1)
+		{
+#ifdef __linux__
+			if (errno == EINVAL && clearDirect(fd))
+			{
+				res = 0;
+				continue;
+			}
+#endif
+			return -1;
+		}
+		if (!res) break;
+	}
+	return total;
+}
+
+
+
+
+/*** With O_DIRECT the last block written must be padded out to the
+     alignment. The file is cut back to size in bulkFinish(). ***/
+ssize_t bulkWrite(int fd, char *buff, size_t len)
+{
+#ifdef __linux__
+	size_t padded;
+	ssize_t res;
+
+	if (job->flags.bulk_io && (fcntl(fd,F_GETFL) & O_DIRECT))
+	{
+		padded = (len + BULK_ALIGN - 1) & ~(size_t)(BULK_ALIGN - 1);
+		memset(buff+len,0,padded-len);
+		if ((res = write(fd,buff,padded)) != -1)
+			return res < (ssize_t)len ? res : (ssize_t)len;
+		if (errno != EINVAL || !clearDirect(fd)) return -1;
+	}
+#endif
+	return write(fd,buff,len);
+}
+
+
+
+
+/*** Called after each block has been copied. Starts writeback of this block,
+     waits for the previous one and then drops both the source and
+     destination pages behind us. dest_fd can be -1. ***/
+void bulkAdvance(int src_fd, int dest_fd, off_t offset, size_t len)
+{
+	if (!job->flags.bulk_io) return;
+#ifdef __linux__
+	posix_fadvise(src_fd,offset,len,POSIX_FADV_DONTNEED);
+	if (dest_fd == -1) return;
+
+	sync_file_range(dest_fd,offset,len,SYNC_FILE_RANGE_WRITE);
+	if (offset >= BULK_BUFFSIZE)
+	{
+		sync_file_range(
+			dest_fd,offset - BULK_BUFFSIZE,BULK_BUFFSIZE,
+			SYNC_FILE_RANGE_WAIT_BEFORE |
+			SYNC_FILE_RANGE_WRITE |
+			SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(
+			dest_fd,
+			offset - BULK_BUFFSIZE,BULK_BUFFSIZE,POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	(void)offset;
+	(void)len;
+#endif
+}
+
+
+
+
+/*** Remove any O_DIRECT padding ***/
+bool bulkFinish(int dest_fd, off_t size)
+{
+	if (!job->flags.bulk_io) return true;
+	return ftruncate(dest_fd,size) != -1;
+}
+
+
+
+
+#ifdef __linux__
+bool clearDirect(int fd)
+{
+	int fl = fcntl(fd,F_GETFL);
+
+	if (fl == -1 || !(fl & O_DIRECT)) return false;
+	return fcntl(fd,F_SETFL,fl & ~O_DIRECT) != -1;
+}
+#endif
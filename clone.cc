@@ -0,0 +1,241 @@
+/*** Clone (-K) and dedupe (-D) modes for copy on write filesystems such as
+     btrfs and XFS. Cloning makes the destination share the source's
+     extents so a copy within one filesystem takes no time or space. If the
+     filesystem can't do it the normal copy is used. Dedupe hashes each
+     destination file that's copied or found unchanged once another of the
+     same size has been seen and if an earlier one had the same hash the
+     kernel is asked to share their extents. It checks the data itself so a
+     hash collision can't do any harm. ***/
+#include "globals.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+#define DEDUPE_MIN_SIZE 16384
+#define DEDUPE_CHUNK    16777216
+
+void dedupeHashed(char *path, off_t size);
+bool dedupeShared(char *path);
+bool dedupeRange(int src_fd, int dest_fd, off_t size, off_t &deduped);
+
+
+/*** Make dest_fd share all of src_fd's extents. Returns 0 if done, 1 if
+     cloning can't be done here or -1 on error. ***/
+int cloneFile(int src_fd, int dest_fd)
+{
+#ifdef FICLONE
+	if (ioctl(dest_fd,FICLONE,src_fd) != -1) return 0;
+	switch(errno)
+	{
+	case EXDEV:
+	case EINVAL:
+	case EOPNOTSUPP:
+	case ENOTTY:
+	case ENOSYS:
+		return 1;
+	}
+	return -1;
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	return 1;
+#endif
+}
+
+
+
+
+/*** As above but from offset to the end of the file. The offset must be a
+     multiple of the filesystem block size. ***/
+int cloneRange(int src_fd, int dest_fd, off_t offset)
+{
+#ifdef FICLONERANGE
+	struct file_clone_range range;
+
+	range.src_fd = src_fd;
+	range.src_offset = offset;
+	range.src_length = 0;
+	range.dest_offset = offset;
+	if (ioctl(dest_fd,FICLONERANGE,&range) != -1) return 0;
+	switch(errno)
+	{
+	case EXDEV:
+	case EINVAL:
+	case EOPNOTSUPP:
+	case ENOTTY:
+	case ENOSYS:
+		return 1;
+	}
+	return -1;
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	(void)offset;
+	return 1;
+#endif
+}
+
+
+
+
+/*** Called with a destination file that's up to date, written says if it
+     was copied in this run. Nothing is read until a second file of the
+     same size turns up as only then could there be a duplicate. Unchanged
+     files whose extents are already shared were done by an earlier run so
+     they're left alone. ***/
+void dedupeFile(char *path, struct stat *st, bool written)
+{
+	vector<string> waiting;
+
+	if (st->st_size < DEDUPE_MIN_SIZE) return;
+	if (!written && dedupeShared(path)) return;
+	{
+		lock_guard<mutex> lock(job->dedupe_mutex);
+		auto it = job->dedupe_sizes.find(st->st_size);
+		if (it == job->dedupe_sizes.end())
+		{
+			job->dedupe_sizes[st->st_size].push_back(path);
+			return;
+		}
+		waiting.swap(it->second);
+	}
+	for(auto &other: waiting) dedupeHashed((char *)other.c_str(),st->st_size);
+	dedupeHashed(path,st->st_size);
+}
+
+
+
+
+/*** If an identical file has already been hashed then share its extents
+     else remember this one ***/
+void dedupeHashed(char *path, off_t size)
+{
+	st_dedupe_key key;
+	uint64_t hash;
+	string other;
+	off_t deduped = 0;
+	int src_fd;
+	int dest_fd;
+
+	if (!hashFile(path,hash,NULL))
+	{
+		logPrintf("WARNING: dedupeHashed(): hashFile(\"%s\"): %s\n",
+			path,strerror(errno));
+		++job->warnings;
+		return;
+	}
+
+	key.size = size;
+	key.hash = hash;
+	{
+		lock_guard<mutex> lock(job->dedupe_mutex);
+		auto it = job->dedupe_files.find(key);
+		if (it == job->dedupe_files.end())
+		{
+			job->dedupe_files[key] = path;
+			return;
+		}
+		other = it->second;
+	}
+	if (other == path) return;
+
+	if ((src_fd = open(other.c_str(),O_RDONLY)) == -1) return;
+	if ((dest_fd = open(path,O_RDWR)) == -1)
+	{
+		close(src_fd);
+		return;
+	}
+	if (dedupeRange(src_fd,dest_fd,size,deduped))
+	{
+		if (job->verbose == VERB_HIGH)
+		{
+			logPrintf("Deduped \"%s\" with \"%s\": %s\n",
+				path,other.c_str(),bytesSizeStr(deduped));
+		}
+		++job->files_deduped;
+		job->bytes_deduped += deduped;
+	}
+	else if (errno && job->verbose == VERB_HIGH)
+	{
+		logPrintf("Can't dedupe \"%s\" with \"%s\": %s\n",
+			path,other.c_str(),strerror(errno));
+	}
+	close(src_fd);
+	close(dest_fd);
+}
+
+
+
+
+/*** Returns true if the file's data is already shared with another file.
+     Only the first extent is looked at. ***/
+bool dedupeShared(char *path)
+{
+#ifdef FIEMAP_EXTENT_SHARED
+	uint64_t physical;
+	uint32_t flags;
+	bool shared;
+	int fd;
+
+	if ((fd = open(path,O_RDONLY)) == -1) return false;
+	shared = (layoutExtent(fd,physical,flags) &&
+	          (flags & FIEMAP_EXTENT_SHARED));
+	close(fd);
+	return shared;
+#else
+	(void)path;
+	return false;
+#endif
+}
+
+
+
+
+/*** Returns true if the whole file was shared. Filesystems limit how much
+     can be done in one go so it's done in chunks. errno is 0 if the data
+     turned out to be different. ***/
+bool dedupeRange(int src_fd, int dest_fd, off_t size, off_t &deduped)
+{
+#ifdef FIDEDUPERANGE
+	alignas(file_dedupe_range)
+	char buff[sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info)];
+	file_dedupe_range *range = (file_dedupe_range *)buff;
+	file_dedupe_range_info *info = &range->info[0];
+	off_t offset;
+
+	for(offset=0;offset < size;offset += info->bytes_deduped)
+	{
+		bzero(buff,sizeof(buff));
+		range->src_offset = offset;
+		range->src_length = min((off_t)DEDUPE_CHUNK,size - offset);
+		range->dest_count = 1;
+		info->dest_fd = dest_fd;
+		info->dest_offset = offset;
+
+		if (ioctl(src_fd,FIDEDUPERANGE,range) == -1) return false;
+		if (info->status < 0)
+		{
+			errno = -info->status;
+			return false;
+		}
+		if (info->status == FILE_DEDUPE_RANGE_DIFFERS ||
+		    !info->bytes_deduped)
+		{
+			errno = 0;
+			return false;
+		}
+		deduped += info->bytes_deduped;
+	}
+	return true;
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	(void)size;
+	(void)deduped;
+	errno = EOPNOTSUPP;
+	return false;
+#endif
+}
@@ -1,26 +1,30 @@
 #include "globals.h"
 
-#define BUFFSIZE  10000
-#define ERROR_EXIT() if (flags.stop_on_error) exit(errno); else ++errors
+#define RESUME_PREFIX    ".filesync."
+#define RESUME_CKP_BYTES 64000000
+#define COPY_RANGE_CHUNK 8388608
 #define META_WARN() \
-	printf("WARNING: Couldn't set metadata: %s\n",strerror(errno));
+	logPrintf("WARNING: Couldn't set metadata: %s\n",strerror(errno));
 #define XATTR_WARN() \
-	printf("WARNING: Couldn't set xattributes: %s\n",strerror(errno));
+	logPrintf("WARNING: Couldn't set xattributes: %s\n",strerror(errno));
 
 namespace fs = std::filesystem;
 
-bool   loadDir(string &dirname, map<string,struct stat> &files_list);
-bool   makeDir(char *src, char *dest, struct stat *src_stat, int depth);
 size_t copyFile(char *src, char *dest, struct stat *src_stat);
+int    copyRange(int src_fd, int dest_fd, size_t &bytes);
+size_t copyFileResumable(
+	char *src, char *dest, int src_fd, struct stat *src_stat);
+bool   loadCheckpoint(string &ckp_path, struct stat *src_stat, off_t &offset);
+bool   saveCheckpoint(string &ckp_path, struct stat *src_stat, off_t offset);
 void   copySymbolicLink(
 	char *src_link,
 	char *dest_link,
 	struct stat *src_stat, struct stat *dest_stat, int depth);
-bool   copyMetaData(char *src, char *dest, struct stat *src_stat, bool symlink);
 bool   copyFileAttrs(char *dest, struct stat *src_stat);
 bool   copyXAttrs(char *src, char *dest, bool symlink);
-bool   sameContents(char *file1, char *file2);
-char  *bytesSizeStr(size_t bytes);
+int    syncXAttrs(char *src, char *dest, bool symlink);
+bool   loadXAttrs(char *path, bool symlink, map<string,string> &attrs);
+void   syncDest(void);
 
 
 /*** Copy the files from source directory to destination directory ***/
@@ -29,27 +33,26 @@ void copyFiles(string &src_dir, string &dest_dir, int depth)
 	map<string,struct stat> src_files;
 	map<string,struct stat> dest_files;
 	map<string,struct stat>::iterator dest_it;
+	vector<map<string,struct stat>::iterator> entries;
 	struct stat *dest_stat;
 	struct stat dest_dir_stat;
 	string src_path;
 	string dest_path;
 	string tmp_path;
-	size_t bytes;
-	char *csrc_path;
-	char *cdest_path;
-	mode_t src_type;
 
 	// Get info about the destination directory
 	if (depth == 1)
 	{
 		if (lstat(dest_dir.c_str(),&dest_dir_stat) == -1)
 		{
-			printf("ERROR: copyFiles(): lstat(\"%s\"): %s\n",
+			logPrintf("ERROR: copyFiles(): lstat(\"%s\"): %s\n",
 				dest_dir.c_str(),strerror(errno));
 			// Error no matter whether -e option given or not as
 			// this is a critical error.
-			exit(1);
+			jobStop(1);
+			return;
 		}
+		if (job->flags.detect_moves) scanMoves();
 	}
 
 	// Get the files to copy
@@ -57,204 +60,405 @@ void copyFiles(string &src_dir, string &dest_dir, int depth)
 
 	if (!src_files.size())
 	{
-		if (verbose == VERB_HIGH)
-			printf("%d: No files in \"%s\"\n",depth,src_dir.c_str());
+		if (job->verbose == VERB_HIGH)
+			logPrintf("%d: No files in \"%s\"\n",depth,src_dir.c_str());
 		// Don't return if set as we might find files to delete
-		if (!flags.delete_unmatched) return;
+		if (!job->flags.delete_unmatched) return;
 	}
 
 	// Find whats already there, doesn't matter if there's nothing
 	loadDir(dest_dir,dest_files);
 
-	if (flags.delete_unmatched)
+	if (job->flags.delete_unmatched)
 	{
 		// Delete any files in the destination dir that arn't in src.
 		// To much hassle to delete directories - would need to recurse
 		for(auto &[name,tmp_stat]: dest_files)
 		{
-			if ((tmp_stat.st_mode & S_IFMT) == S_IFREG &&
-			     findName(name,src_files) == src_files.end())
+			if (job->stopped) return;
+			if (findName(name,src_files) == src_files.end())
 			{
 				tmp_path = dest_dir + "/" + name;
-				if (verbose)
-				{
-					printf("%d: Deleting unmatched file \"%s\".\n",
-						depth,tmp_path.c_str());
-				}
-				if (unlink(tmp_path.c_str()) == -1)
-				{
-					printf("ERROR: copyFiles(): unlink(\"%s\"): %s\n",
-						tmp_path.c_str(),strerror(errno));
-					ERROR_EXIT();
-				}
-				++unmatched_deleted;
+				deleteUnmatched(name,tmp_path,&tmp_stat,depth);
 			}
 		}
 	}
 
 	// Go through source files and dirs to copy
-	for(auto &[name,src_stat]: src_files)
+	for(auto it=src_files.begin();it != src_files.end();++it)
+		entries.push_back(it);
+	if (job->flags.layout_order) layoutEntries(src_dir,entries,dest_files);
+
+	for(auto &it: entries)
 	{
+		auto &[name,src_stat] = *it;
+
+		if (job->stopped) return;
 		src_path = src_dir + "/" + name;
 		dest_path = dest_dir + "/" + name;
-		csrc_path = (char *)src_path.c_str();
-		cdest_path = (char *)dest_path.c_str();
-		src_type = src_stat.st_mode & S_IFMT;
 
 		// Check we're not copying a directory into itself or we'll
 		// end up with recursion until we hit max path length or crash
-		if (src_type == S_IFDIR &&
+		if ((src_stat.st_mode & S_IFMT) == S_IFDIR &&
 		    depth == 1 && 
 		    src_stat.st_dev == dest_dir_stat.st_dev &&
 		    src_stat.st_ino == dest_dir_stat.st_ino)
 		{
-			if (verbose)
+			if (job->verbose)
 			{
-				printf("%d: WARNING: Cannot copy directory \"%s\" into itself.\n",
-					depth,csrc_path);
+				logPrintf("%d: WARNING: Cannot copy directory \"%s\" into itself.\n",
+					depth,src_path.c_str());
 			}
-			++warnings;
+			++job->warnings;
 			continue;
 		}
 
-		// Switch on the file type in the source directory
-		switch(src_type)
+		if ((dest_it = findName(name,dest_files)) != dest_files.end())
+			dest_stat = &dest_it->second;
+		else
+			dest_stat = NULL;
+
+		copyEntry(name,src_path,dest_path,&src_stat,dest_stat,depth,true);
+	}
+	if (depth > 1)
+	{
+		if (job->verbose == VERB_HIGH)
+		{
+			logPrintf("%d: Leaving directory \"%s\"...\n",
+				depth,src_dir.c_str());
+		}
+		return;
+	}
+
+	// Back at top level , depth = 1
+	if (job->flags.detect_moves) deleteDeferred();
+	finishSync();
+}
+
+
+
+
+/*** Copy a single directory entry if it needs copying. dest_stat is NULL if
+     it doesn't exist in the destination. If recurse is set then directories
+     are descended into. ***/
+void copyEntry(
+	const string &name,
+	string &src_path,
+	string &dest_path,
+	struct stat *src_stat, struct stat *dest_stat, int depth, bool recurse)
+{
+	size_t bytes;
+	string rel_path;
+	int errors;
+	char *csrc_path = (char *)src_path.c_str();
+	char *cdest_path = (char *)dest_path.c_str();
+	mode_t src_type = src_stat->st_mode & S_IFMT;
+
+	// Another shard's
+	if (job->shard_count &&
+	    !shardOwns(src_path.substr(job->dir_src.size()),src_type == S_IFDIR))
+	{
+		return;
+	}
+
+	// Switch on the file type in the source directory
+	switch(src_type)
+	{
+	case S_IFREG:
+		// If we have patterns to match see if the file does
+		if (!nameMatched(name))
 		{
-		case S_IFREG:
-			// If we have patterns to match see if the file does
-			if (!nameMatched(name))
+			if (job->verbose == VERB_HIGH)
 			{
-				if (verbose == VERB_HIGH)
-				{
-					printf("%d: Not copying file \"%s\" as the name doesn't match any pattern.\n",
-						depth,cdest_path);
-				}
-				continue;
+				logPrintf("%d: Not copying file \"%s\" as the name doesn't match any pattern.\n",
+					depth,cdest_path);
 			}
+			return;
+		}
 
-			/* Find if file is in the destination directory and
-			   whether its the same size. If it is then do nothing
-			   unless contents differ */
-			if ((dest_it = findName(name,dest_files)) != dest_files.end() &&
-			     dest_it->second.st_size == src_stat.st_size)
+		/* Find if file is in the destination directory and
+		   whether its the same size. If it is then do nothing
+		   unless contents differ */
+		if (dest_stat && dest_stat->st_size == src_stat->st_size)
+		{
+			// If flag set check contents
+			if (job->flags.compare_contents)
 			{
-				// If flag set check contents
-				if (flags.compare_contents && 
-				    sameContents(csrc_path,cdest_path))
+				if (!sameContents(csrc_path,cdest_path))
+					goto COPY;
+				if (job->verbose == VERB_HIGH)
 				{
-					if (verbose == VERB_HIGH)
-					{
-						printf("%d: Not copying \"%s\" as it has the same contents as '%s'.\n",
-							depth,
-							cdest_path,csrc_path);
-					}
-					break;
+					logPrintf("%d: Not copying \"%s\" as it has the same contents as '%s'.\n",
+						depth,
+						cdest_path,csrc_path);
 				}
-				if (verbose == VERB_HIGH)
+			}
+			/* We set the mtime when copying so if it's different
+			   the file has probably been changed in place */
+			else if (job->flags.copy_metadata &&
+			         !sameMTime(src_stat,dest_stat))
+			{
+				if (job->verbose == VERB_HIGH)
 				{
-					printf("%d: Not copying \"%s\" as it is the same size as '%s'.\n",
+					logPrintf("%d: Copying \"%s\" as its modification time differs from '%s'.\n",
 						depth,cdest_path,csrc_path);
 				}
-				break;
+				goto COPY;
 			}
-			if (verbose)
+			else if (job->verbose == VERB_HIGH)
 			{
-				printf("%d: Copying file \"%s\" to \"%s\": ",
-					depth,csrc_path,cdest_path);
-				fflush(stdout);
+				logPrintf("%d: Not copying \"%s\" as it is the same size as '%s'.\n",
+					depth,cdest_path,csrc_path);
 			}
-			bytes = copyFile(csrc_path,cdest_path,&src_stat);
-			if ((long)bytes != -1 && verbose)
-				printf("%s OK\n",bytesSizeStr(bytes));
-			break;
+			/* Changing a link's metadata or xattributes would change
+			   the other links too, eg in a previous -L snapshot, so
+			   it needs its own copy */
+			if (dest_stat->st_nlink > 1 &&
+			    ((job->flags.copy_metadata &&
+			      metaDataDiffs(src_stat,dest_stat).size()) ||
+			     (job->flags.copy_xattrs &&
+			      !sameXAttrs(csrc_path,cdest_path,false)))) goto COPY;
+
+			updateMetaData(csrc_path,cdest_path,src_stat,dest_stat,depth);
+			if (job->flags.dedupe) dedupeFile(cdest_path,dest_stat,false);
+			return;
+		}
+		// A new file might be an old one that's been moved
+		if (!dest_stat &&
+		    job->flags.detect_moves &&
+		    moveFile(src_path,dest_path,src_stat,depth)) return;
+
+		COPY:
+		// Never write through a link, eg into a previous snapshot
+		if (dest_stat && dest_stat->st_nlink > 1)
+		{
+			if (unlink(cdest_path) == -1)
+			{
+				logPrintf("ERROR: copyEntry(): unlink(\"%s\"): %s\n",
+					cdest_path,strerror(errno));
+				ERROR_EXIT();
+				return;
+			}
+			dest_stat = NULL;
+		}
+		if (job->link_dest != "" &&
+		    !dest_stat && linkDest(src_path,dest_path,src_stat,depth))
+			return;
+		if (job->verbose)
+		{
+			logCopyStart(to_string(depth) + ": Copying file \"" +
+				src_path + "\" to \"" + dest_path + "\"");
+		}
+		if (job->progress_secs) progressFile(csrc_path);
+		if (job->flags.append &&
+		    dest_stat &&
+		    dest_stat->st_size && dest_stat->st_size < src_stat->st_size)
+			bytes = appendFile(csrc_path,cdest_path,src_stat,dest_stat);
+		else
+			bytes = copyFile(csrc_path,cdest_path,src_stat);
+		if (job->progress_secs) progressFile("");
+		if ((long)bytes == -1) return;
+		if (job->verbose) logCopyDone(dest_path,bytes);
+		if (job->flags.dedupe) dedupeFile(cdest_path,src_stat,true);
+		return;
 
-		case S_IFDIR:
-			if (makeDir(csrc_path,cdest_path,&src_stat,depth))
+	case S_IFDIR:
+		// Skip excluded subtrees before we touch them
+		rel_path = src_path.substr(job->dir_src.size());
+		if (job->dir_rules.size() && dirExcluded(name,rel_path))
+		{
+			if (job->verbose == VERB_HIGH)
 			{
-				if (errno != EEXIST)
-				{
-					++dirs_copied;
-					++total_copied;
-				}
-				if (verbose == VERB_HIGH)
+				logPrintf("%d: Not descending into excluded directory \"%s\".\n",
+					depth,csrc_path);
+			}
+			return;
+		}
+		// And ones a previous interrupted run finished
+		if (recurse && dest_stat && treeCkpDone(rel_path,src_stat))
+		{
+			if (job->verbose == VERB_HIGH)
+			{
+				logPrintf("%d: Skipping directory \"%s\" done by the last run.\n",
+					depth,csrc_path);
+			}
+			return;
+		}
+		if (makeDir(csrc_path,cdest_path,src_stat,depth))
+		{
+			if (errno != EEXIST)
+			{
+				++job->dirs_copied;
+				++job->total_copied;
+				dest_stat = NULL;
+			}
+			if (recurse)
+			{
+				if (job->verbose == VERB_HIGH)
 				{
-					printf("%d: Descending into directory \"%s\"...\n",
+					logPrintf("%d: Descending into directory \"%s\"...\n",
 						depth,csrc_path);
 				}
+				errors = job->errors;
 				copyFiles(src_path,dest_path,depth+1);
+				if (job->stopped) return;
+				if (job->errors == errors) treeCkpSave(rel_path,src_stat);
 			}
-			break;
-
-		case S_IFLNK:
-			if (!nameMatched(name))
+			/* Last so a read only directory can still be filled. With
+			   -H every shard gets here but only one needs to do it
+			   and other shards may not have finished with it so a
+			   read only one is left for a run without -H. */
+			if (job->shard_count && !(src_stat->st_mode & S_IWUSR))
 			{
-				if (verbose == VERB_HIGH)
+				if (job->verbose == VERB_HIGH)
 				{
-					printf("%d: Not copying symlink \"%s\" as the name doesn't match any pattern.\n",
+					logPrintf("%d: Leaving metadata of read only directory \"%s\" for a run without -H.\n",
 						depth,cdest_path);
 				}
-				continue;
-			}
-			// See if in destination dir
-			if ((dest_it = findName(name,dest_files)) != dest_files.end())
-			{
-				// Check if link
-				dest_stat = &dest_it->second;
-				if ((dest_stat->st_mode & S_IFMT) != src_type)
-				{
-					printf("ERROR: Destination \"%s\" exists and it is not a symlink.\n",
-						cdest_path);
-					ERROR_EXIT();
-					break;
-				}
 			}
-			else dest_stat = NULL;
-
-			copySymbolicLink(
-				csrc_path,cdest_path,&src_stat,dest_stat,depth);
-			break;
+			else if (shardOwns(rel_path,false))
+				updateMetaData(csrc_path,cdest_path,src_stat,dest_stat,depth);
+		}
+		return;
 
-		default:
-			if (verbose == VERB_HIGH)
+	case S_IFLNK:
+		if (!nameMatched(name))
+		{
+			if (job->verbose == VERB_HIGH)
 			{
-				printf("%d: Ignoring directory entry \"%s\" of type %d\n",
-					depth,csrc_path,src_type);
+				logPrintf("%d: Not copying symlink \"%s\" as the name doesn't match any pattern.\n",
+					depth,cdest_path);
 			}
+			return;
 		}
-	}
-	if (depth > 1)
-	{
-		if (verbose == VERB_HIGH)
+		// Check if link
+		if (dest_stat && (dest_stat->st_mode & S_IFMT) != src_type)
 		{
-			printf("%d: Leaving directory \"%s\"...\n",
-				depth,src_dir.c_str());
+			logPrintf("ERROR: Destination \"%s\" exists and it is not a symlink.\n",
+				cdest_path);
+			ERROR_EXIT();
+			return;
 		}
+		copySymbolicLink(csrc_path,cdest_path,src_stat,dest_stat,depth);
 		return;
+
+	default:
+		if (job->verbose == VERB_HIGH)
+		{
+			logPrintf("%d: Ignoring directory entry \"%s\" of type %d\n",
+				depth,csrc_path,src_type);
+		}
 	}
+}
 
-	// Back at top level , depth = 1
-	if (!total_copied && !unmatched_deleted)
+
+
+
+/*** Delete a file in the destination that isn't in the source. Only
+     regular files are deleted. ***/
+void deleteUnmatched(
+	const string &name, string &dest_path, struct stat *dest_stat, int depth)
+{
+	// Leave part copied files alone so they can be resumed
+	if ((dest_stat->st_mode & S_IFMT) != S_IFREG ||
+	    !name.compare(0,strlen(RESUME_PREFIX),RESUME_PREFIX)) return;
+
+	// With -H another shard might own it
+	if (job->shard_count &&
+	    !shardOwns(dest_path.substr(job->dir_dest.size()),false)) return;
+
+	// Might be wanted later on as a moved file
+	if (job->flags.detect_moves && deferDelete(dest_path)) return;
+
+	if (job->verbose)
+	{
+		logPrintf("%d: Deleting unmatched file \"%s\".\n",
+			depth,dest_path.c_str());
+	}
+	if (unlink(dest_path.c_str()) == -1)
 	{
-		puts("Nothing to update.");
+		logPrintf("ERROR: deleteUnmatched(): unlink(\"%s\"): %s\n",
+			dest_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+	}
+	++job->unmatched_deleted;
+}
+
+
+
+
+/*** Sync the disks and print the totals ***/
+void finishSync(void)
+{
+	progressStop();
+	if (job->stopped) return;
+
+	if (!job->total_copied &&
+	    !job->unmatched_deleted &&
+	    !job->files_moved &&
+	    !job->files_deduped && !job->meta_updated && !job->files_linked)
+	{
+		logPuts("Nothing to update.");
 		return;
 	}
 
-	if (verbose) puts("\nSyncing...");
-	sync();
+	if (job->sync_mode != SYNC_NONE)
+	{
+		if (job->verbose) logPuts("\nSyncing...");
+		if (job->sync_mode == SYNC_FS)
+			syncDest();
+		else
+			sync();
+	}
+
+	if (job->verbose) printStats(*job);
+}
+
+
+
+
+void printStats(const SyncStats &stats)
+{
+	logPrintf("\nFiles copied        : %d (%s)\n",
+		stats.files_copied.load(),bytesSizeStr(stats.bytes_copied));
+	logPrintf("Files appended      : %d\n",stats.files_appended.load());
+	logPrintf("Files moved         : %d\n",stats.files_moved.load());
+	logPrintf("Hard linked         : %d\n",stats.files_linked.load());
+	logPrintf("Files cloned        : %d\n",stats.files_cloned.load());
+	logPrintf("Files deduped       : %d (%s)\n",
+		stats.files_deduped.load(),bytesSizeStr(stats.bytes_deduped));
+	logPrintf("Metadata updated    : %d\n",stats.meta_updated.load());
+	logPrintf("Symlinks copied     : %d\n",stats.symlinks_copied.load());
+	logPrintf("Directories copied  : %d\n",stats.dirs_copied.load());
+	logPrintf("Total FS objs copied: %d\n",stats.total_copied.load());
+	logPrintf("Xattributes copied  : %d from %d filesystem objects\n",
+		stats.xattr_copied.load(),stats.xattr_files.load());
+	logPrintf("Unmatched deleted   : %d\n",stats.unmatched_deleted.load());
+	logPrintf("Warnings            : %d\n",stats.warnings.load());
+	logPrintf("Errors              : %d\n\n",stats.errors.load());
+}
+
+
+
 
-	if (verbose)
+/*** Only flush the destination filesystem rather than all of them. Falls
+     back to sync() if that can't be done. ***/
+void syncDest(void)
+{
+#ifdef __linux__
+	int fd;
+
+	if ((fd = open(job->dir_dest.c_str(),O_RDONLY | O_DIRECTORY)) != -1)
 	{
-		printf("\nFiles copied        : %d (%s)\n",
-			files_copied,bytesSizeStr(bytes_copied));
-		printf("Symlinks copied     : %d\n",symlinks_copied);
-		printf("Directories copied  : %d\n",dirs_copied);
-		printf("Total FS objs copied: %d\n",total_copied);
-		printf("Xattributes copied  : %d from %d filesystem objects\n",
-			xattr_copied,xattr_files);
-		printf("Unmatched deleted   : %d\n",unmatched_deleted);
-		printf("Warnings            : %d\n",warnings);
-		printf("Errors              : %d\n\n",errors);
+		if (syncfs(fd) != -1)
+		{
+			close(fd);
+			return;
+		}
+		close(fd);
 	}
+#endif
+	sync();
 }
 
 
@@ -273,12 +477,12 @@ bool loadDir(string &dirname, map<string,struct stat> &files_list)
 
 			if (name == "." || 
 			    name == ".." ||
-		            (!flags.copy_dot_files && name[0] == '.')) continue;
+		            (!job->flags.copy_dot_files && name[0] == '.')) continue;
 
 			string path = file.path().string();
 			if (lstat(path.c_str(),&fs) == -1)
 			{
-				printf("ERROR: loadDir(): lstat(\"%s\"): %s\n",
+				logPrintf("ERROR: loadDir(): lstat(\"%s\"): %s\n",
 					path.c_str(),strerror(errno));
 				ERROR_EXIT();
 			}
@@ -287,7 +491,7 @@ bool loadDir(string &dirname, map<string,struct stat> &files_list)
 	}
 	catch(fs::filesystem_error &e)
 	{
-		printf("ERROR: loadDir(): directory_iterator(): %s\n",e.what());
+		logPrintf("ERROR: loadDir(): directory_iterator(): %s\n",e.what());
 		ERROR_EXIT();
 		return false;
 	}
@@ -303,10 +507,10 @@ bool makeDir(char *src, char *dest, struct stat *src_stat, int depth)
 
 	if (mkdir(dest,0755) != -1)
 	{
-		if (verbose)
-			printf("%d: Creating directory \"%s\": ",depth,dest);
-		if (copyMetaData(src,dest,src_stat,false) && verbose)
-			puts("OK");
+		if (job->verbose)
+			logPrintf("%d: Creating directory \"%s\": ",depth,dest);
+		if (copyMetaData(src,dest,src_stat,false) && job->verbose)
+			logPuts("OK");
 		return true;
 	}
 
@@ -315,21 +519,21 @@ bool makeDir(char *src, char *dest, struct stat *src_stat, int depth)
 		// Make sure its a dir
 		if (lstat(dest,&fs) == -1)
 		{
-			printf("ERROR: makeDir(): lstat(\"%s\"): %s\n",
+			logPrintf("ERROR: makeDir(): lstat(\"%s\"): %s\n",
 				dest,strerror(errno));
 			ERROR_EXIT();
 			return false;
 		}
 		if ((fs.st_mode & S_IFMT) != S_IFDIR)
 		{
-			printf("ERROR: Destination \"%s\" exists and it is not a directory.\n",dest);
+			logPrintf("ERROR: Destination \"%s\" exists and it is not a directory.\n",dest);
 			ERROR_EXIT();
 			return false;
 		}
 	}
 	else 
 	{
-		printf("ERROR: makeDir(): mkdir(\"%s\"): %s\n",
+		logPrintf("ERROR: makeDir(): mkdir(\"%s\"): %s\n",
 			dest,strerror(errno));
 		ERROR_EXIT();
 		return false;
@@ -342,28 +546,32 @@ bool makeDir(char *src, char *dest, struct stat *src_stat, int depth)
 
 size_t copyFile(char *src, char *dest, struct stat *src_stat)
 {
-	char buff[BUFFSIZE];
+	char *buff = bulkBuffer(0);
+	size_t buffsize = job->flags.bulk_io ? BULK_BUFFSIZE : job->buff_size;
 	size_t bytes;
 	int src_fd;
 	int dest_fd;
 	int wrote;
 	int len;
+	int res;
 
 	// Open source file to read
-	if ((src_fd = open(src,O_RDONLY)) == -1)
+	if ((src_fd = bulkOpen(src,O_RDONLY,0)) == -1)
 	{
-		printf("ERROR: copyFile(): open(\"%s\"): %s\n",
+		logPrintf("ERROR: copyFile(): open(\"%s\"): %s\n",
 			src,strerror(errno));
 		ERROR_EXIT();
 		return -1;
 	}
+	if (job->resume_size && (size_t)src_stat->st_size >= job->resume_size)
+		return copyFileResumable(src,dest,src_fd,src_stat);
 
 	// Open destination file to write
-	if ((dest_fd = open(
+	if ((dest_fd = bulkOpen(
 		dest,
 		O_RDWR | O_CREAT | O_TRUNC,src_stat->st_mode)) == -1)
 	{
-		printf("ERROR: copyFile(): open(\"%s\"): %s\n",
+		logPrintf("ERROR: copyFile(): open(\"%s\"): %s\n",
 			dest,strerror(errno));
 		ERROR_EXIT();
 		close(src_fd);
@@ -371,15 +579,57 @@ size_t copyFile(char *src, char *dest, struct stat *src_stat)
 	}
 	bytes = 0;
 	wrote = 0;
-	while((len = read(src_fd,buff,BUFFSIZE)) > 0)
+	len = 0;
+	res = 1;
+
+	// Sharing the source's extents beats copying them
+	if (job->flags.clone && (res = cloneFile(src_fd,dest_fd)) == -1)
 	{
-		if ((wrote = write(dest_fd,buff,len)) == -1)
+		logPrintf("ERROR: copyFile(): ioctl(FICLONE): %s\n",
+			strerror(errno));
+		ERROR_EXIT();
+		wrote = -1;
+	}
+	else if (!res)
+	{
+		bytes = src_stat->st_size;
+		job->bytes_done.fetch_add(bytes,memory_order_relaxed);
+		++job->files_cloned;
+	}
+	else
+	{
+		bulkStart(src_fd,dest_fd,src_stat->st_size);
+		if (job->copy_engine == ENGINE_COPY_RANGE && !job->flags.bulk_io)
+			res = copyRange(src_fd,dest_fd,bytes);
+		if (res == -1)
 		{
-			printf("ERROR: copyFile(): write(): %s\n",strerror(errno));
+			logPrintf("ERROR: copyFile(): copy_file_range(): %s\n",
+				strerror(errno));
 			ERROR_EXIT();
-			break;
+			wrote = -1;
+		}
+	}
+	if (res == 1)
+	{
+		while((len = bulkRead(src_fd,buff,buffsize)) > 0)
+		{
+			if ((wrote = bulkWrite(dest_fd,buff,len)) == -1)
+			{
+				logPrintf("ERROR: copyFile(): write(): %s\n",
+					strerror(errno));
+				ERROR_EXIT();
+				break;
+			}
+			bulkAdvance(src_fd,dest_fd,bytes,wrote);
+			bytes += wrote;
+			job->bytes_done.fetch_add(wrote,memory_order_relaxed);
 		}
-		bytes += wrote;
+	}
+	if (wrote != -1 && len != -1 && !bulkFinish(dest_fd,bytes))
+	{
+		logPrintf("ERROR: copyFile(): ftruncate(): %s\n",strerror(errno));
+		ERROR_EXIT();
+		wrote = -1;
 	}
 	close(src_fd);
 	close(dest_fd);
@@ -387,13 +637,13 @@ size_t copyFile(char *src, char *dest, struct stat *src_stat)
 
 	if (len == -1)
 	{
-		printf("ERROR: copyFile(): read(): %s\n",strerror(errno));
+		logPrintf("ERROR: copyFile(): read(): %s\n",strerror(errno));
 		ERROR_EXIT();
 		return -1;
 	}
-	++files_copied;
-	++total_copied;
-	bytes_copied += bytes;
+	++job->files_copied;
+	++job->total_copied;
+	job->bytes_copied += bytes;
 
 	return copyMetaData(src,dest,src_stat,false) ? bytes : -1;
 }
@@ -401,13 +651,253 @@ size_t copyFile(char *src, char *dest, struct stat *src_stat)
 
 
 
+/*** Copy using copy_file_range() so the data stays in the kernel and
+     filesystems that can do server side copies or share extents do so.
+     Returns 0 if done, 1 if it can't be used for these files so read and
+     write must be or -1 on error. ***/
+int copyRange(int src_fd, int dest_fd, size_t &bytes)
+{
+#ifdef __linux__
+	ssize_t len;
+
+	while((len = copy_file_range(
+		src_fd,NULL,dest_fd,NULL,COPY_RANGE_CHUNK,0)) > 0)
+	{
+		bytes += len;
+		job->bytes_done.fetch_add(len,memory_order_relaxed);
+	}
+	if (!len) return 0;
+	if (!bytes &&
+	    (errno == EXDEV ||
+	     errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP))
+	{
+		return 1;
+	}
+	return -1;
+#else
+	(void)src_fd;
+	(void)dest_fd;
+	(void)bytes;
+	return 1;
+#endif
+}
+
+
+
+
+/*** Copy a large file into a temporary file in the destination directory,
+     saving a checkpoint of how far we've got every RESUME_CKP_BYTES. If a
+     previous run was interrupted and the source is the same file with the
+     same size and mtime then carry on from the checkpoint. When done the
+     temporary file is renamed over the destination. ***/
+size_t copyFileResumable(
+	char *src, char *dest, int src_fd, struct stat *src_stat)
+{
+	char *buff = bulkBuffer(0);
+	size_t buffsize = job->flags.bulk_io ? BULK_BUFFSIZE : job->buff_size;
+	struct stat part_stat;
+	string dest_str = dest;
+	string part_path;
+	string ckp_path;
+	size_t bytes;
+	size_t pos;
+	off_t offset;
+	off_t ckp_offset;
+	bool cloned;
+	int dest_fd;
+	int wrote;
+	int len;
+
+	pos = dest_str.rfind('/') + 1;
+	part_path = dest_str.substr(0,pos) + RESUME_PREFIX + dest_str.substr(pos);
+	ckp_path = part_path + ".ckp";
+	part_path += ".part";
+
+	if (!loadCheckpoint(ckp_path,src_stat,offset)) offset = 0;
+
+	if ((dest_fd = bulkOpen(part_path.c_str(),O_RDWR | O_CREAT,0600)) == -1)
+	{
+		logPrintf("ERROR: copyFileResumable(): open(\"%s\"): %s\n",
+			part_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		close(src_fd);
+		return -1;
+	}
+
+	// If the part file has gone or been cut short start again
+	if (offset &&
+	    (fstat(dest_fd,&part_stat) == -1 || part_stat.st_size < offset))
+	{
+		if (job->verbose) logPrintf("part file short, restarting: ");
+		offset = 0;
+	}
+
+	// Anything written after the last checkpoint can't be trusted
+	if (ftruncate(dest_fd,offset) == -1 ||
+	    lseek(dest_fd,offset,SEEK_SET) == -1 ||
+	    lseek(src_fd,offset,SEEK_SET) == -1)
+	{
+		logPrintf("ERROR: copyFileResumable(): seek(\"%s\"): %s\n",
+			part_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		close(src_fd);
+		close(dest_fd);
+		return -1;
+	}
+	if (offset && job->verbose)
+		logPrintf("resuming at %s: ",bytesSizeStr(offset));
+
+	bytes = 0;
+	wrote = 0;
+	len = 0;
+	cloned = false;
+	ckp_offset = offset;
+
+	/* The rest can be cloned in one go if the checkpoint is on a block
+	   boundary, which it will be unless the buffer size is odd */
+	if (job->flags.clone &&
+	    !(offset % src_stat->st_blksize) &&
+	    !cloneRange(src_fd,dest_fd,offset))
+	{
+		bytes = src_stat->st_size - offset;
+		job->bytes_done.fetch_add(bytes,memory_order_relaxed);
+		offset = src_stat->st_size;
+		cloned = true;
+		++job->files_cloned;
+	}
+	else bulkStart(src_fd,dest_fd,src_stat->st_size);
+
+	while(!cloned && (len = bulkRead(src_fd,buff,buffsize)) > 0)
+	{
+		if ((wrote = bulkWrite(dest_fd,buff,len)) == -1)
+		{
+			logPrintf("ERROR: copyFileResumable(): write(): %s\n",
+				strerror(errno));
+			ERROR_EXIT();
+			break;
+		}
+		bulkAdvance(src_fd,dest_fd,offset,wrote);
+		bytes += wrote;
+		job->bytes_done.fetch_add(wrote,memory_order_relaxed);
+		offset += wrote;
+
+		// Data must be on disk before the checkpoint says it is
+		if (offset - ckp_offset >= RESUME_CKP_BYTES)
+		{
+			if (fdatasync(dest_fd) == -1 ||
+			    !saveCheckpoint(ckp_path,src_stat,offset))
+			{
+				logPrintf("ERROR: copyFileResumable(): checkpoint(\"%s\"): %s\n",
+					ckp_path.c_str(),strerror(errno));
+				ERROR_EXIT();
+				wrote = -1;
+				break;
+			}
+			ckp_offset = offset;
+		}
+	}
+	close(src_fd);
+	job->bytes_copied += bytes;
+
+	if (wrote == -1)
+	{
+		close(dest_fd);
+		return -1;
+	}
+	if (len == -1)
+	{
+		logPrintf("ERROR: copyFileResumable(): read(): %s\n",
+			strerror(errno));
+		ERROR_EXIT();
+		close(dest_fd);
+		return -1;
+	}
+	if (!bulkFinish(dest_fd,offset) ||
+	    fdatasync(dest_fd) == -1 || close(dest_fd) == -1)
+	{
+		logPrintf("ERROR: copyFileResumable(): sync(\"%s\"): %s\n",
+			part_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return -1;
+	}
+	if (fchmodat(AT_FDCWD,part_path.c_str(),src_stat->st_mode & 07777,0) == -1 ||
+	    rename(part_path.c_str(),dest) == -1)
+	{
+		logPrintf("ERROR: copyFileResumable(): rename(\"%s\"): %s\n",
+			part_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return -1;
+	}
+	unlink(ckp_path.c_str());
+
+	++job->files_copied;
+	++job->total_copied;
+
+	return copyMetaData(src,dest,src_stat,false) ? bytes : -1;
+}
+
+
+
+
+/*** Read a checkpoint and return the offset the copy got to if it was for
+     this version of the source file ***/
+bool loadCheckpoint(string &ckp_path, struct stat *src_stat, off_t &offset)
+{
+	FILE *fp;
+	unsigned long long dev;
+	unsigned long long ino;
+	long long size;
+	long long mtime;
+	long long off;
+	int cnt;
+
+	if (!(fp = fopen(ckp_path.c_str(),"r"))) return false;
+	cnt = fscanf(fp,"%llu %llu %lld %lld %lld",&dev,&ino,&size,&mtime,&off);
+	fclose(fp);
+
+	if (cnt != 5 ||
+	    dev != (unsigned long long)src_stat->st_dev ||
+	    ino != (unsigned long long)src_stat->st_ino ||
+	    size != (long long)src_stat->st_size ||
+	    mtime != (long long)src_stat->st_mtime ||
+	    off < 0 || off > size) return false;
+
+	offset = off;
+	return true;
+}
+
+
+
+
+/*** Write the checkpoint to a temporary file then rename it so we never 
+     leave a half written one behind ***/
+bool saveCheckpoint(string &ckp_path, struct stat *src_stat, off_t offset)
+{
+	string tmp_path = ckp_path + ".tmp";
+	FILE *fp;
+	bool ok;
+
+	if (!(fp = fopen(tmp_path.c_str(),"w"))) return false;
+	ok = fprintf(fp,"%llu %llu %lld %lld %lld\n",
+		(unsigned long long)src_stat->st_dev,
+		(unsigned long long)src_stat->st_ino,
+		(long long)src_stat->st_size,
+		(long long)src_stat->st_mtime,
+		(long long)offset) > 0;
+	ok = (fflush(fp) == 0 && fsync(fileno(fp)) == 0 && ok);
+	fclose(fp);
+	return ok && rename(tmp_path.c_str(),ckp_path.c_str()) == 0;
+}
+
+
+
+
 void copySymbolicLink(
 	char *src_link,
 	char *dest_link,
 	struct stat *src_stat, struct stat *dest_stat, int depth)
 {
 	char *src_target = new char[src_stat->st_size+1];
-	char *dest_target = NULL;
 	ssize_t len;
 
 	// Auto delete mem on function exit
@@ -415,13 +905,30 @@ void copySymbolicLink(
 
 	if ((len = readlink(src_link,src_target,src_stat->st_size)) == -1)
 	{
-		printf("ERROR: copySymbolicLink(): readlink(): %s\n",
+		logPrintf("ERROR: copySymbolicLink(): readlink(): %s\n",
 			strerror(errno));
 		ERROR_EXIT();
 		return;
 	}
 	src_target[len] = 0;
 
+	setSymbolicLink(src_link,src_target,dest_link,src_stat,dest_stat,depth);
+}
+
+
+
+
+/*** Create the symlink pointing to src_target if it doesn't already exist.
+     src_link is only needed for xattributes and can be NULL. ***/
+void setSymbolicLink(
+	char *src_link,
+	char *src_target,
+	char *dest_link,
+	struct stat *src_stat, struct stat *dest_stat, int depth)
+{
+	char *dest_target = NULL;
+	ssize_t len;
+
 	// If link already exists...
 	if (dest_stat)
 	{
@@ -430,7 +937,7 @@ void copySymbolicLink(
 
 		if ((len = readlink(dest_link,dest_target,dest_stat->st_size)) == -1)
 		{
-			printf("ERROR: copySymbolicLink(): readlink(): %s\n",
+			logPrintf("ERROR: setSymbolicLink(): readlink(): %s\n",
 				strerror(errno));
 			ERROR_EXIT();
 			return;
@@ -440,48 +947,49 @@ void copySymbolicLink(
 		// If its already pointing to the right thing don't do anything
 		if (!strcmp(src_target,dest_target))
 		{
-			if (verbose == VERB_HIGH)
+			if (job->verbose == VERB_HIGH)
 			{
-				printf("%d: Symlink \"%s\" already exists and is set correctly.\n",
+				logPrintf("%d: Symlink \"%s\" already exists and is set correctly.\n",
 					depth,dest_link);
 			}
+			updateMetaData(src_link,dest_link,src_stat,dest_stat,depth);
 			return;
 		}
 
 		// Pointing to something else. Only update if flag set.
-		if (!flags.compare_contents) 
+		if (!job->flags.compare_contents) 
 		{
-			printf("%d: WARNING: Symlink \"%s\" already exists but -> \"%s\". \n",
+			logPrintf("%d: WARNING: Symlink \"%s\" already exists but -> \"%s\". \n",
 				depth,dest_link,dest_target);
 			return;
 		}
-		printf("%d: Symlink \"%s\" already exists but -> \"%s\". Deleting: ",
+		logPrintf("%d: Symlink \"%s\" already exists but -> \"%s\". Deleting: ",
 			depth,dest_link,dest_target);
 		if (unlink(dest_link) == -1)
 		{
-			printf("ERROR: copySymbolicLink(): unlink(\"%s\"): %s\n",
+			logPrintf("ERROR: setSymbolicLink(): unlink(\"%s\"): %s\n",
 				dest_link,strerror(errno));
 			ERROR_EXIT();
 			return;
 		}
-		puts("OK");
+		logPuts("OK");
 	}
-	if (verbose)
+	if (job->verbose)
 	{
-		printf("%d: Creating symlink \"%s\" -> \"%s\": ",
+		logPrintf("%d: Creating symlink \"%s\" -> \"%s\": ",
 			depth,dest_link,src_target);
 	}
 	if (symlink(src_target,dest_link) == -1)
 	{
-		printf("ERROR: copySymbolicLink(): symlink(): %s\n",
+		logPrintf("ERROR: setSymbolicLink(): symlink(): %s\n",
 			strerror(errno));
 		ERROR_EXIT();
 		return;
 	}
-	if (copyMetaData(src_link,dest_link,src_stat,true) && verbose)
-		puts("OK");
-	++symlinks_copied;
-	++total_copied;
+	if (copyMetaData(src_link,dest_link,src_stat,true) && job->verbose)
+		logPuts("OK");
+	++job->symlinks_copied;
+	++job->total_copied;
 }
 
 
@@ -491,20 +999,21 @@ bool copyMetaData(char *src, char *dest, struct stat *src_stat, bool symlink)
 {
 	bool ret = true;
 
-	if (flags.copy_metadata)
+	if (job->flags.copy_metadata)
 	{
 		if (!(ret = copyFileAttrs(dest,src_stat)))
 		{
-			if (verbose) META_WARN();
+			if (job->verbose) META_WARN();
 		}
 	}
-	// Only try to copy xattributes if normal metadata copy went ok
-	if (ret)
+	// Only try to copy xattributes if normal metadata copy went ok. There's
+	// no source to copy them from if its on the other end of a remote sync
+	if (ret && src)
 	{
-		if (flags.copy_xattrs)
+		if (job->flags.copy_xattrs)
 		{
 			ret = copyXAttrs(src,dest,symlink);
-			if (verbose && !ret) XATTR_WARN();
+			if (job->verbose && !ret) XATTR_WARN();
 		}
 	}
 	return ret;
@@ -516,7 +1025,7 @@ bool copyMetaData(char *src, char *dest, struct stat *src_stat, bool symlink)
 /*** Copy the standard file attributes from the source file ***/
 bool copyFileAttrs(char *dest, struct stat *src_stat)
 {
-	if (!flags.copy_metadata) return true;
+	if (!job->flags.copy_metadata) return true;
 
 	struct timeval tv[2];
 	bool ok = true;
@@ -529,10 +1038,15 @@ bool copyFileAttrs(char *dest, struct stat *src_stat)
 	}
 	/* Soft link permissions appear to be hardcoded to 777 on linux and
 	   calling fchmodat() just gives an operation not supported error so
-	   don't bother */
+	   don't bother. Directories are done by updateMetaData() once they've
+	   been filled. Files need it as open() applies the umask. */
 #ifdef __APPLE__
 	if (fchmodat(AT_FDCWD,dest,src_stat->st_mode,AT_SYMLINK_NOFOLLOW) == -1)
 		ok = false;
+#else
+	if (S_ISREG(src_stat->st_mode) &&
+	    fchmodat(AT_FDCWD,dest,src_stat->st_mode & 07777,0) == -1)
+		ok = false;
 #endif
 
 	// Only need time to the nearest second.
@@ -548,7 +1062,7 @@ bool copyFileAttrs(char *dest, struct stat *src_stat)
 #endif
 	if (lutimes(dest,tv) == -1) ok = false; 
 
-	warnings += (ok == false);
+	job->warnings += (ok == false);
 
 	return ok;
 }
@@ -566,9 +1080,9 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 
 	// Get the key list length first then allocate memory for it.
 #ifdef __APPLE__
-	int flags = 0;
-	if (symlink) flags = XATTR_NOFOLLOW;
-	if ((size = listxattr(src,NULL,0,flags)) == -1)
+	int xflags = 0;
+	if (symlink) xflags = XATTR_NOFOLLOW;
+	if ((size = listxattr(src,NULL,0,xflags)) == -1)
 #else
 	if (symlink)
 		size = llistxattr(src,NULL,0);
@@ -582,7 +1096,7 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 	char *keybuf = new char[size];
 	unique_ptr<char[]> ukeybuf(keybuf);
 #ifdef __APPLE__
-	if (listxattr(src,keybuf,size,flags) == -1)
+	if (listxattr(src,keybuf,size,xflags) == -1)
 #else
 	if (symlink)
 		size = llistxattr(src,keybuf,size);
@@ -608,7 +1122,7 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 
 		// Get value length
 #ifdef __APPLE__
-		vallen = getxattr(src,key,NULL,0,0,flags);
+		vallen = getxattr(src,key,NULL,0,0,xflags);
 #else
 		// Linux has a seperate function for interrogating symlinks
 		if (symlink)
@@ -623,7 +1137,7 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 
 		// Get the value
 #ifdef __APPLE__
-		res = getxattr(src,key,value,vallen,0,flags);
+		res = getxattr(src,key,value,vallen,0,xflags);
 #else
 		if (symlink)
 			res = lgetxattr(src,key,value,vallen);
@@ -636,7 +1150,7 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 		// Set key-value pair in new filesystem object. For this
 		// function MacOS has a positions parameter, linux doesn't.
 #ifdef __APPLE__
-		res = setxattr(dest,key,value,vallen,0,flags);
+		res = setxattr(dest,key,value,vallen,0,xflags);
 #else
 		if (symlink)
 			res = lsetxattr(dest,key,value,vallen,0);
@@ -644,9 +1158,216 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
 			res = setxattr(dest,key,value,vallen,0);
 #endif
 		if (res == -1) return false;
-		++xattr_copied;
+		++job->xattr_copied;
+	}
+	if (key != keybuf) ++job->xattr_files;
+	return true;
+}
+
+
+
+
+/*** Bring the metadata of something whose data is up to date into line
+     with the source without copying it again. dest_stat is NULL for a
+     directory that was only just created, that doesn't count as an update.
+     src is only needed for xattributes and can be NULL. ***/
+void updateMetaData(
+	char *src,
+	char *dest, struct stat *src_stat, struct stat *dest_stat, int depth)
+{
+	struct stat fs;
+	string diffs;
+	bool created = false;
+	bool symlink = S_ISLNK(src_stat->st_mode);
+	bool ok = true;
+	int res;
+
+	if (!dest_stat)
+	{
+		if (lstat(dest,&fs) == -1) return;
+		dest_stat = &fs;
+		created = true;
+	}
+	if (job->flags.copy_metadata &&
+	    (diffs = metaDataDiffs(src_stat,dest_stat)).size())
+	{
+		ok = copyFileAttrs(dest,src_stat);
+		if (S_ISDIR(src_stat->st_mode) &&
+		    fchmodat(AT_FDCWD,dest,src_stat->st_mode & 07777,0) == -1)
+		{
+			++job->warnings;
+			ok = false;
+		}
+		if (!ok && job->verbose) META_WARN();
+	}
+	if (src && job->flags.copy_xattrs)
+	{
+		if ((res = syncXAttrs(src,dest,symlink)) == 1)
+			diffs += (diffs.size() ? ", xattrs" : "xattrs");
+		else if (res == -1 && job->verbose)
+			XATTR_WARN();
+	}
+	if (!diffs.size() || created) return;
+
+	if (job->verbose)
+	{
+		logPrintf("%d: Updated metadata of \"%s\" (%s)\n",
+			depth,dest,diffs.c_str());
+	}
+	++job->meta_updated;
+}
+
+
+
+
+/*** Returns a list of the standard metadata that differs or "" if none.
+     Directory mtimes change whenever something is added so they're not
+     compared, nor are symlink modes as linux doesn't have them. ***/
+string metaDataDiffs(struct stat *src_stat, struct stat *dest_stat)
+{
+	string diffs;
+
+	if (!S_ISLNK(src_stat->st_mode) &&
+	    (src_stat->st_mode & 07777) != (dest_stat->st_mode & 07777))
+	{
+		diffs = "mode";
+	}
+	if (src_stat->st_uid != dest_stat->st_uid ||
+	    src_stat->st_gid != dest_stat->st_gid)
+	{
+		diffs += (diffs.size() ? ", owner" : "owner");
+	}
+	if (!S_ISDIR(src_stat->st_mode) && !sameMTime(src_stat,dest_stat))
+		diffs += (diffs.size() ? ", mtime" : "mtime");
+	return diffs;
+}
+
+
+
+
+bool sameMTime(struct stat *src_stat, struct stat *dest_stat)
+{
+#ifdef __APPLE__
+	return src_stat->st_mtimespec.tv_sec == dest_stat->st_mtimespec.tv_sec;
+#else
+	return src_stat->st_mtim.tv_sec == dest_stat->st_mtim.tv_sec;
+#endif
+}
+
+
+
+
+/*** Returns true if both have the same xattributes. False if either can't
+     be read. ***/
+bool sameXAttrs(char *path1, char *path2, bool symlink)
+{
+	map<string,string> attrs1;
+	map<string,string> attrs2;
+
+	return loadXAttrs(path1,symlink,attrs1) &&
+	       loadXAttrs(path2,symlink,attrs2) && attrs1 == attrs2;
+}
+
+
+
+
+/*** Make the destination's xattributes the same as the source's including
+     removing any it has that the source doesn't. Returns 1 if anything
+     changed, 0 if nothing needed to or -1 on error. ***/
+int syncXAttrs(char *src, char *dest, bool symlink)
+{
+	map<string,string> src_attrs;
+	map<string,string> dest_attrs;
+	int res;
+
+	if (!loadXAttrs(src,symlink,src_attrs) ||
+	    !loadXAttrs(dest,symlink,dest_attrs)) return -1;
+	if (src_attrs == dest_attrs) return 0;
+
+	for(auto &[key,value]: dest_attrs)
+	{
+		if (src_attrs.find(key) != src_attrs.end()) continue;
+#ifdef __APPLE__
+		res = removexattr(dest,key.c_str(),symlink ? XATTR_NOFOLLOW : 0);
+#else
+		if (symlink)
+			res = lremovexattr(dest,key.c_str());
+		else
+			res = removexattr(dest,key.c_str());
+#endif
+		if (res == -1) return -1;
+	}
+	for(auto &[key,value]: src_attrs)
+	{
+		auto it = dest_attrs.find(key);
+		if (it != dest_attrs.end() && it->second == value) continue;
+#ifdef __APPLE__
+		res = setxattr(
+			dest,key.c_str(),
+			value.data(),value.size(),0,symlink ? XATTR_NOFOLLOW : 0);
+#else
+		if (symlink)
+			res = lsetxattr(dest,key.c_str(),value.data(),value.size(),0);
+		else
+			res = setxattr(dest,key.c_str(),value.data(),value.size(),0);
+#endif
+		if (res == -1) return -1;
+		++job->xattr_copied;
+	}
+	++job->xattr_files;
+	return 1;
+}
+
+
+
+
+bool loadXAttrs(char *path, bool symlink, map<string,string> &attrs)
+{
+	vector<char> keys;
+	vector<char> value;
+	ssize_t size;
+	ssize_t len;
+
+#ifdef __APPLE__
+	int xflags = (symlink ? XATTR_NOFOLLOW : 0);
+	size = listxattr(path,NULL,0,xflags);
+#else
+	size = (symlink ? llistxattr(path,NULL,0) : listxattr(path,NULL,0));
+#endif
+	if (size == -1) return false;
+	if (!size) return true;
+
+	keys.resize(size);
+#ifdef __APPLE__
+	size = listxattr(path,keys.data(),size,xflags);
+#else
+	if (symlink)
+		size = llistxattr(path,keys.data(),size);
+	else
+		size = listxattr(path,keys.data(),size);
+#endif
+	if (size == -1) return false;
+
+	for(char *key=keys.data();key < keys.data() + size;key += strlen(key) + 1)
+	{
+#ifdef __APPLE__
+		len = getxattr(path,key,NULL,0,0,xflags);
+#else
+		len = (symlink ? lgetxattr(path,key,NULL,0) : getxattr(path,key,NULL,0));
+#endif
+		if (len == -1) return false;
+		value.resize(len);
+#ifdef __APPLE__
+		len = getxattr(path,key,value.data(),len,0,xflags);
+#else
+		if (symlink)
+			len = lgetxattr(path,key,value.data(),len);
+		else
+			len = getxattr(path,key,value.data(),len);
+#endif
+		if (len == -1) return false;
+		attrs[key].assign(value.data(),len);
 	}
-	if (key != keybuf) ++xattr_files;
 	return true;
 }
 
@@ -657,42 +1378,59 @@ bool copyXAttrs(char *src, char *dest, bool symlink)
      same size ***/
 bool sameContents(char *file1, char *file2)
 {
-	FILE *fp1;
-	FILE *fp2;
+	char *buff1 = bulkBuffer(0);
+	char *buff2 = bulkBuffer(1);
+	size_t buffsize = job->flags.bulk_io ? BULK_BUFFSIZE : job->buff_size;
+	off_t offset;
 	bool ret;
-	int c1;
-	int c2;
+	int fd1;
+	int fd2;
+	int len1;
+	int len2;
 
-	if (!(fp1 = fopen(file1,"r")))
+	if ((fd1 = bulkOpen(file1,O_RDONLY,0)) == -1)
 	{
-		printf("ERROR: sameContents(): fopen(\"%s\"): %s\n",
+		logPrintf("ERROR: sameContents(): open(\"%s\"): %s\n",
 			file1,strerror(errno));
 		ERROR_EXIT();
 		return false;
 	}
-	if (!(fp2 = fopen(file2,"r")))
+	if ((fd2 = bulkOpen(file2,O_RDONLY,0)) == -1)
 	{
-		fclose(fp1);
-		printf("ERROR: sameContents(): fopen(\"%s\"): %s\n",
+		close(fd1);
+		logPrintf("ERROR: sameContents(): open(\"%s\"): %s\n",
 			file2,strerror(errno));
 		ERROR_EXIT();
 		return false;
 	}
+	bulkStart(fd1,-1,0);
+	bulkStart(fd2,-1,0);
 
 	ret = true;
-	do
+	for(offset=0;;offset += len1)
 	{
-		c1 = fgetc(fp1);
-		c2 = fgetc(fp2);
-		if (c1 != c2)
+		len1 = bulkRead(fd1,buff1,buffsize);
+		len2 = bulkRead(fd2,buff2,buffsize);
+		if (len1 == -1 || len2 == -1)
 		{
+			logPrintf("ERROR: sameContents(): read(): %s\n",
+				strerror(errno));
+			ERROR_EXIT();
 			ret = false;
 			break;
 		}
-	} while(c1 != EOF && c2 != EOF);
+		if (len1 != len2 || memcmp(buff1,buff2,len1))
+		{
+			ret = false;
+			break;
+		}
+		if (!len1) break;
+		bulkAdvance(fd1,-1,offset,len1);
+		bulkAdvance(fd2,-1,offset,len2);
+	}
 
-	fclose(fp1);
-	fclose(fp2);
+	close(fd1);
+	close(fd2);
 
 	return ret;
 }
@@ -702,7 +1440,7 @@ bool sameContents(char *file1, char *file2)
 
 char *bytesSizeStr(size_t bytes)
 {
-	static char str[20];
+	static thread_local char str[20];
 
 	/* Only start printing in kilobytes from 10000 as eg 2345 bytes is
 	   still easy to read */
@@ -716,3 +1454,40 @@ char *bytesSizeStr(size_t bytes)
 		snprintf(str,sizeof(str),"%.2fG",(double)bytes / 1e9);
 	return str;
 }
+
+
+
+
+/*** Start a verbose "Copying..." line. If no other thread can log before
+     the copy finishes it's flushed so it shows straight away and
+     logCopyDone() adds the result to it. Otherwise it's a line of its own
+     and so is the result so they can't get mixed with other threads'. ***/
+void logCopyStart(const string &line)
+{
+	if (logOneThread())
+	{
+		logPrintf("%s: ",line.c_str());
+		logFlush();
+	}
+	else logPrintf("%s\n",line.c_str());
+}
+
+
+
+
+void logCopyDone(const string &path, size_t bytes)
+{
+	if (logOneThread())
+		logPrintf("%s OK\n",bytesSizeStr(bytes));
+	else
+		logPrintf("Finished \"%s\": %s OK\n",path.c_str(),bytesSizeStr(bytes));
+}
+
+
+
+
+/*** The receiver handles one message at a time ***/
+bool logOneThread(void)
+{
+	return job->threads == 1 || job->flags.receiver;
+}
@@ -0,0 +1,297 @@
+/*** The library interface. Each SyncEngine owns a job holding its options,
+     counts and working state. Whichever thread is doing work for a job has
+     the thread local job pointer set to it so the rest of the code doesn't
+     need to pass it around. ***/
+#define MAINFILE
+#include "globals.h"
+
+
+SyncOptions::SyncOptions(void)
+{
+	bzero(&flags,sizeof(flags));
+	flags.stop_on_error = 1;
+	flags.copy_metadata = 1;
+	resume_size = 0;
+	buff_size = BUFFSIZE;
+	copy_engine = ENGINE_RW;
+	sync_mode = SYNC_ALL;
+	verbose = VERB_NORMAL;
+	regex_type = REGEX_NONE;
+	threads = 0;
+	progress_secs = 0;
+	audit_sample = 0;
+	shard_index = 0;
+	shard_count = 0;
+}
+
+
+
+
+SyncStats::SyncStats(void)
+{
+	bytes_copied = 0;
+	bytes_done = 0;
+	bytes_deduped = 0;
+	files_copied = 0;
+	symlinks_copied = 0;
+	dirs_copied = 0;
+	xattr_copied = 0;
+	xattr_files = 0;
+	total_copied = 0;
+	unmatched_deleted = 0;
+	files_moved = 0;
+	files_cloned = 0;
+	files_deduped = 0;
+	meta_updated = 0;
+	files_linked = 0;
+	files_appended = 0;
+	files_audited = 0;
+	audit_missing = 0;
+	audit_extra = 0;
+	audit_type = 0;
+	audit_size = 0;
+	audit_content = 0;
+	audit_metadata = 0;
+	errors = 0;
+	warnings = 0;
+}
+
+
+
+
+/********************************* THREAD POOL *******************************/
+
+SyncPool::SyncPool(int num_threads)
+{
+	stop = false;
+	for(int i=0;i < num_threads;++i) workers.emplace_back(&SyncPool::worker,this);
+}
+
+
+
+
+SyncPool::~SyncPool(void)
+{
+	{
+		lock_guard<mutex> lock(pool_mutex);
+		stop = true;
+	}
+	pool_cond.notify_all();
+	for(auto &w: workers) w.join();
+}
+
+
+
+
+void SyncPool::submit(function<void(void)> task)
+{
+	{
+		lock_guard<mutex> lock(pool_mutex);
+		tasks.push_back(task);
+	}
+	pool_cond.notify_one();
+}
+
+
+
+
+void SyncPool::worker(void)
+{
+	function<void(void)> task;
+
+	while(true)
+	{
+		{
+			unique_lock<mutex> lock(pool_mutex);
+			pool_cond.wait(lock,[this]{ return stop || tasks.size(); });
+			if (!tasks.size()) return;
+			task = tasks.front();
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+
+/*********************************** ENGINE **********************************/
+
+SyncEngine::SyncEngine(const SyncOptions &options, SyncPool *pool)
+{
+	sync_job = new st_job(options,pool);
+}
+
+
+
+
+SyncEngine::~SyncEngine(void)
+{
+	delete sync_job;
+}
+
+
+
+
+/*** Do the sync. Returns 0 if it all went well or the errno of whatever
+     stopped it. Errors that didn't stop it (-e) are in the stats. An audit
+     that finds differences returns 1. ***/
+int SyncEngine::run(void)
+{
+	st_job *prev = job;
+
+	job = sync_job;
+	if (jobInit())
+	{
+		if (job->flags.audit) auditTrees();
+		else if (job->flags.file_list)
+		{
+			if (job->progress_secs) progressStart();
+			copyFileList();
+		}
+		else
+		{
+			if (job->checkpoint_path != "") treeCkpStart();
+			if (job->progress_secs) progressStart();
+			copyFiles(job->dir_src,job->dir_dest,1);
+			treeCkpFinish();
+		}
+		progressStop();
+	}
+	if (job->stats_file != "") statsWrite();
+	job = prev;
+	return sync_job->exit_code;
+}
+
+
+
+
+/*** Can be called from any thread. The sync stops at the next file. ***/
+void SyncEngine::cancel(void)
+{
+	lock_guard<mutex> lock(sync_job->job_mutex);
+	if (!sync_job->exit_code) sync_job->exit_code = ECANCELED;
+	sync_job->stopped = true;
+}
+
+
+
+
+const SyncStats &SyncEngine::stats(void)
+{
+	return *sync_job;
+}
+
+
+/************************************ JOBS ***********************************/
+
+st_job::st_job(const SyncOptions &options, SyncPool *sync_pool):
+	SyncOptions(options)
+{
+	pool = sync_pool;
+	stopped = false;
+	exit_on_stop = false;
+	exit_code = 0;
+	tasks_running = 0;
+	next_path = 0;
+	audit_next = 0;
+	audit_seed = 0;
+	progress_stop = false;
+	total_bytes = 0;
+	total_items = 0;
+	listen_fd = -1;
+	ckp_fp = NULL;
+	ckp_flushed = 0;
+	for(auto &slot: slots)
+	{
+		slot.seq = 0;
+		slot.claimed = false;
+		slot.used = false;
+		slot.path[0] = 0;
+	}
+}
+
+
+
+
+st_job::~st_job(void)
+{
+	for(auto &regex: comp_regex) regfree(&regex);
+}
+
+
+
+
+/*** Set up the current job. Returns false if it can't be run. ***/
+bool jobInit(void)
+{
+	regex_t regex;
+	char errstr[100];
+	int err;
+
+	if (job->regex_type != REGEX_NONE && !job->comp_regex.size())
+	{
+		for(auto &pat: job->patterns)
+		{
+			if ((err = regcomp(&regex,pat.c_str(),REG_EXTENDED)))
+			{
+				regerror(err,&regex,errstr,sizeof(errstr));
+				logPrintf("ERROR: Invalid regex: %s\n",errstr);
+				job->exit_code = EINVAL;
+				return false;
+			}
+			job->comp_regex.push_back(regex);
+		}
+	}
+
+	// 0 threads means pick for us
+	if (job->flags.auto_tune) tuneStart();
+	if (!job->threads) job->threads = DEFAULT_THREADS;
+	return true;
+}
+
+
+
+
+/*** Stop the current job. Anything walking the trees or working through a
+     file list checks the stopped flag and returns. ***/
+void jobStop(int code)
+{
+	{
+		lock_guard<mutex> lock(job->job_mutex);
+		if (!job->exit_code) job->exit_code = (code ? code : 1);
+		job->stopped = true;
+	}
+	if (job->exit_on_stop) exit(job->exit_code);
+}
+
+
+
+
+/*** Run the task on num threads from the pool and wait for them all. If the
+     engine wasn't given a pool it gets its own. ***/
+void jobTasks(int num, function<void(void)> task)
+{
+	st_job *j = job;
+	int i;
+
+	if (!j->pool)
+	{
+		j->own_pool = make_unique<SyncPool>(num);
+		j->pool = j->own_pool.get();
+	}
+	j->tasks_running = num;
+
+	for(i=0;i < num;++i)
+	{
+		j->pool->submit([j,task]
+		{
+			job = j;
+			task();
+			job = NULL;
+
+			lock_guard<mutex> lock(j->job_mutex);
+			if (!--j->tasks_running) j->job_cond.notify_all();
+		});
+	}
+	unique_lock<mutex> lock(j->job_mutex);
+	j->job_cond.wait(lock,[j]{ return !j->tasks_running; });
+}
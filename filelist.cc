@@ -0,0 +1,266 @@
+/*** File list mode (-f). Instead of walking both trees only the paths given
+     in the list, relative to the source dir, are looked at. Paths are
+     processed in parallel by a number of worker threads. ***/
+#include "globals.h"
+
+void copyFileListWorker(void);
+void copyListedPath(string &rel_path);
+bool tidyListedPath(string &rel_path);
+bool makeParentDirs(string &rel_path, int &depth);
+void finishParentDirs(void);
+
+
+/*** Load the list of paths. If there are any NUL characters in it then its
+     assumed to be NUL separated (eg from find -print0) else newline. A
+     filename of "-" means stdin. ***/
+bool SyncOptions::loadFileList(const char *filename)
+{
+	FILE *fp;
+	string data;
+	string path;
+	char buff[BUFFSIZE];
+	char sep;
+	size_t len;
+
+	if (!strcmp(filename,"-"))
+		fp = stdin;
+	else if (!(fp = fopen(filename,"r")))
+		return false;
+
+	while((len = fread(buff,1,sizeof(buff),fp)) > 0) data.append(buff,len);
+	if (fp != stdin) fclose(fp);
+
+	sep = (data.find('\0') == string::npos ? '\n' : '\0');
+
+	for(char c: data)
+	{
+		if (c == sep)
+		{
+			if (path.size()) file_list.push_back(path);
+			path.clear();
+		}
+		else path += c;
+	}
+	if (path.size()) file_list.push_back(path);
+	flags.file_list = 1;
+	return true;
+}
+
+
+
+
+/*** Start the workers on the pool and wait for them to finish ***/
+void copyFileList(void)
+{
+	struct stat fs;
+
+	if (lstat(job->dir_dest.c_str(),&fs) == -1)
+	{
+		logPrintf("ERROR: copyFileList(): lstat(\"%s\"): %s\n",
+			job->dir_dest.c_str(),strerror(errno));
+		jobStop(1);
+		return;
+	}
+	if (job->flags.layout_order) layoutList();
+	job->next_path = 0;
+	jobTasks(job->threads,copyFileListWorker);
+	if (!job->stopped) finishParentDirs();
+
+	finishSync();
+}
+
+
+
+
+void copyFileListWorker(void)
+{
+	size_t num;
+
+	while(!job->stopped && (num = job->next_path++) < job->file_list.size())
+		copyListedPath(job->file_list[num]);
+}
+
+
+
+
+/*** Apply the normal copy, symlink and delete decisions to one path ***/
+void copyListedPath(string &rel_path)
+{
+	struct stat src_stat;
+	struct stat dest_stat;
+	string src_path;
+	string dest_path;
+	string name;
+	size_t pos;
+	int depth;
+
+	if (!tidyListedPath(rel_path)) return;
+
+	// Nothing in a dot directory either. The path's tidy so any component
+	// starting with a dot is at the start or after a slash.
+	if (!job->flags.copy_dot_files &&
+	    (rel_path[0] == '.' || rel_path.find("/.") != string::npos)) return;
+
+	pos = rel_path.rfind('/');
+	name = (pos == string::npos ? rel_path : rel_path.substr(pos+1));
+
+	src_path = job->dir_src + "/" + rel_path;
+	dest_path = job->dir_dest + "/" + rel_path;
+
+	if (!makeParentDirs(rel_path,depth)) return;
+
+	if (lstat(src_path.c_str(),&src_stat) == -1)
+	{
+		if (errno != ENOENT)
+		{
+			logPrintf("ERROR: copyListedPath(): lstat(\"%s\"): %s\n",
+				src_path.c_str(),strerror(errno));
+			ERROR_EXIT();
+			return;
+		}
+		// Gone from the source so maybe delete it from the destination
+		if (job->flags.delete_unmatched &&
+		    lstat(dest_path.c_str(),&dest_stat) != -1)
+		{
+			deleteUnmatched(name,dest_path,&dest_stat,depth);
+		}
+		return;
+	}
+	if (lstat(dest_path.c_str(),&dest_stat) == -1)
+	{
+		if (errno != ENOENT)
+		{
+			logPrintf("ERROR: copyListedPath(): lstat(\"%s\"): %s\n",
+				dest_path.c_str(),strerror(errno));
+			ERROR_EXIT();
+			return;
+		}
+		copyEntry(name,src_path,dest_path,&src_stat,NULL,depth,false);
+	}
+	else copyEntry(name,src_path,dest_path,&src_stat,&dest_stat,depth,false);
+}
+
+
+
+
+/*** Remove empty and "." components so eg "./a//b/" becomes "a/b". Returns
+     false if there's nothing left or a ".." which could reach outside the
+     source and destination dirs. ***/
+bool tidyListedPath(string &rel_path)
+{
+	string tidied;
+	string comp;
+	size_t pos;
+	size_t start;
+
+	for(start=0;start <= rel_path.size();start=pos+1)
+	{
+		if ((pos = rel_path.find('/',start)) == string::npos)
+			pos = rel_path.size();
+		comp = rel_path.substr(start,pos-start);
+		if (comp == "" || comp == ".") continue;
+		if (comp == "..")
+		{
+			logPrintf("WARNING: Ignoring listed path \"%s\" as it contains \"..\".\n",
+				rel_path.c_str());
+			++job->warnings;
+			return false;
+		}
+		if (tidied.size()) tidied += '/';
+		tidied += comp;
+	}
+	rel_path = tidied;
+	return rel_path.size() != 0;
+}
+
+
+
+
+/*** Create any parent directories of the path that don't exist in the
+     destination yet. Each is only checked once and remembered, along with
+     whether it was created, for finishParentDirs(). Also sets the depth of
+     the path. Returns false if a parent couldn't be made or is excluded. ***/
+bool makeParentDirs(string &rel_path, int &depth)
+{
+	struct stat fs;
+	string parent;
+	string src_path;
+	string dest_path;
+	size_t pos;
+	size_t start;
+	bool created;
+
+	depth = 1;
+	for(start=0;(pos = rel_path.find('/',start)) != string::npos;start=pos+1)
+	{
+		++depth;
+		parent = rel_path.substr(0,pos);
+		{
+			lock_guard<mutex> lock(job->made_dirs_mutex);
+			if (job->made_dirs.count(parent)) continue;
+		}
+		if (job->dir_rules.size() &&
+		    dirExcluded(parent.substr(start),"/" + parent)) return false;
+
+		src_path = job->dir_src + "/" + parent;
+		dest_path = job->dir_dest + "/" + parent;
+		if (lstat(src_path.c_str(),&fs) == -1)
+		{
+			// Whole directory gone so nothing to do
+			if (errno == ENOENT) return false;
+			logPrintf("ERROR: makeParentDirs(): lstat(\"%s\"): %s\n",
+				src_path.c_str(),strerror(errno));
+			ERROR_EXIT();
+			return false;
+		}
+		if ((fs.st_mode & S_IFMT) != S_IFDIR) return false;
+
+		if (!makeDir(
+			(char *)src_path.c_str(),
+			(char *)dest_path.c_str(),&fs,depth-1)) return false;
+		if ((created = (errno != EEXIST)))
+		{
+			++job->dirs_copied;
+			++job->total_copied;
+		}
+		lock_guard<mutex> lock(job->made_dirs_mutex);
+		job->made_dirs[parent] |= created;
+	}
+	return true;
+}
+
+
+
+
+/*** Once everything in them is done give the parent directories the
+     source's metadata as copyEntry() does when walking the tree. Children
+     sort after their parents so going backwards does them first. ***/
+void finishParentDirs(void)
+{
+	struct stat src_stat;
+	struct stat dest_stat;
+	string src_path;
+	string dest_path;
+	int depth;
+
+	for(auto it=job->made_dirs.rbegin();it != job->made_dirs.rend();++it)
+	{
+		if (job->stopped) return;
+
+		auto &[parent,created] = *it;
+		src_path = job->dir_src + "/" + parent;
+		dest_path = job->dir_dest + "/" + parent;
+		if (lstat(src_path.c_str(),&src_stat) == -1 ||
+		    lstat(dest_path.c_str(),&dest_stat) == -1) continue;
+
+		// As in copyEntry(), another shard may still be filling it
+		if (job->shard_count && !(src_stat.st_mode & S_IWUSR)) continue;
+		if (!shardOwns("/" + parent,false)) continue;
+
+		depth = 1 + count(parent.begin(),parent.end(),'/');
+		updateMetaData(
+			(char *)src_path.c_str(),
+			(char *)dest_path.c_str(),
+			&src_stat,created ? NULL : &dest_stat,depth);
+	}
+}
@@ -0,0 +1,179 @@
+/*** Library interface to filesync. A SyncEngine runs one sync with the
+     options it was given and returns an error code rather than ending the
+     process. Any number of engines can run at the same time in one process,
+     each from its own thread, and they can share a SyncPool for the threads
+     that file list mode copies with. ***/
+#ifndef FILESYNC_H
+#define FILESYNC_H
+
+#include <stddef.h>
+
+#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+#define DEFAULT_THREADS  4
+
+enum
+{
+	VERB_NONE,
+	VERB_NORMAL,
+	VERB_HIGH
+};
+
+enum
+{
+	REGEX_NONE,
+	REGEX_PARTIAL,
+	REGEX_FULL
+};
+
+enum
+{
+	ENGINE_RW,
+	ENGINE_COPY_RANGE
+};
+
+enum
+{
+	SYNC_ALL,
+	SYNC_FS,
+	SYNC_NONE
+};
+
+struct st_flags
+{
+	unsigned stop_on_error    : 1;
+	unsigned delete_unmatched : 1;
+	unsigned copy_dot_files   : 1;
+	unsigned copy_metadata    : 1;
+	unsigned copy_xattrs      : 1;
+	unsigned compare_contents : 1;
+	unsigned ignore_case      : 1;
+	unsigned bulk_io          : 1;
+	unsigned file_list        : 1;
+	unsigned receiver         : 1;
+	unsigned detect_moves     : 1;
+	unsigned auto_tune        : 1;
+	unsigned readahead        : 1;
+	unsigned clone            : 1;
+	unsigned dedupe           : 1;
+	unsigned layout_order     : 1;
+	unsigned audit            : 1;
+	unsigned shard_subtree    : 1;
+	unsigned append           : 1;
+};
+
+struct st_dir_rule
+{
+	std::string pattern;
+	bool include;
+	bool anchored;
+};
+
+/* What to sync and how. These are the command line options. */
+struct SyncOptions
+{
+	std::unordered_set<std::string> patterns;
+	std::vector<st_dir_rule> dir_rules;
+	std::vector<std::string> file_list;
+	std::string dir_src;
+	std::string dir_dest;
+	std::string status_path;
+	std::string checkpoint_path;
+	std::string stats_file;
+	std::string link_dest;
+	struct st_flags flags;
+	size_t resume_size;
+	size_t buff_size;
+	int copy_engine;
+	int sync_mode;
+	int verbose;
+	int regex_type;
+	int threads;
+	int progress_secs;
+	int audit_sample;
+	int shard_index;
+	int shard_count;
+
+	SyncOptions(void);
+	void addDirRule(const std::string &pattern, bool include);
+	bool loadDirRules(const char *filename);
+	bool loadFileList(const char *filename);
+};
+
+/* Counts that can be read while the sync is running */
+struct SyncStats
+{
+	std::atomic<size_t> bytes_copied;
+	std::atomic<size_t> bytes_done;
+	std::atomic<size_t> bytes_deduped;
+	std::atomic<int> files_copied;
+	std::atomic<int> symlinks_copied;
+	std::atomic<int> dirs_copied;
+	std::atomic<int> xattr_copied;
+	std::atomic<int> xattr_files;
+	std::atomic<int> total_copied;
+	std::atomic<int> unmatched_deleted;
+	std::atomic<int> files_moved;
+	std::atomic<int> files_cloned;
+	std::atomic<int> files_deduped;
+	std::atomic<int> meta_updated;
+	std::atomic<int> files_linked;
+	std::atomic<int> files_appended;
+	std::atomic<int> files_audited;
+	std::atomic<int> audit_missing;
+	std::atomic<int> audit_extra;
+	std::atomic<int> audit_type;
+	std::atomic<int> audit_size;
+	std::atomic<int> audit_content;
+	std::atomic<int> audit_metadata;
+	std::atomic<int> errors;
+	std::atomic<int> warnings;
+
+	SyncStats(void);
+};
+
+/* Worker threads shared by any number of engines */
+class SyncPool
+{
+public:
+	SyncPool(int num_threads);
+	~SyncPool(void);
+	void submit(std::function<void(void)> task);
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void(void)>> tasks;
+	std::mutex pool_mutex;
+	std::condition_variable pool_cond;
+	bool stop;
+
+	void worker(void);
+};
+
+struct st_job;
+
+class SyncEngine
+{
+public:
+	SyncEngine(const SyncOptions &options, SyncPool *pool = NULL);
+	SyncEngine(const SyncEngine &) = delete;
+	SyncEngine &operator=(const SyncEngine &) = delete;
+	~SyncEngine(void);
+
+	int run(void);
+	void cancel(void);
+	const SyncStats &stats(void);
+
+private:
+	st_job *sync_job;
+};
+
+#endif
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <ctype.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <regex.h>
 #include <sys/stat.h>
@@ -16,8 +18,20 @@
 #include <string>
 #include <memory>
 #include <filesystem>
+#include <atomic>
+#include <unordered_map>
 
-#define VERSION "20240731"
+#include "filesync.h"
+
+#define VERSION "20261019"
+
+#define BUFFSIZE         10000
+#define BULK_BUFFSIZE    1048576
+#define DEFAULT_PROGRESS 5
+#define HASH_BLOCK       BULK_BUFFSIZE
+#define PROGRESS_SLOTS   32
+
+#define ERROR_EXIT() if (job->flags.stop_on_error) jobStop(errno); else ++job->errors
 
 #ifdef MAINFILE
 #define EXTERN
@@ -29,52 +43,244 @@ using namespace std;
 
 enum
 {
-	VERB_NONE,
-	VERB_NORMAL,
-	VERB_HIGH
+	LOG_TEXT,
+	LOG_JSON
 };
 
-enum
+struct st_move_key
+{
+	off_t size;
+	time_t mtime;
+
+	bool operator==(const st_move_key &k) const
+	{
+		return size == k.size && mtime == k.mtime;
+	}
+};
+
+struct st_move_key_hash
+{
+	size_t operator()(const st_move_key &k) const;
+};
+
+struct st_dedupe_key
 {
-	REGEX_NONE,
-	REGEX_PARTIAL,
-	REGEX_FULL
+	off_t size;
+	uint64_t hash;
+
+	bool operator==(const st_dedupe_key &k) const
+	{
+		return size == k.size && hash == k.hash;
+	}
 };
 
-struct st_flags
+struct st_dedupe_key_hash
 {
-	unsigned stop_on_error    : 1;
-	unsigned delete_unmatched : 1;
-	unsigned copy_dot_files   : 1;
-	unsigned copy_metadata    : 1;
-	unsigned copy_xattrs      : 1;
-	unsigned compare_contents : 1;
-	unsigned ignore_case      : 1;
+	size_t operator()(const st_dedupe_key &k) const { return k.hash; }
 };
 
-EXTERN unordered_set<string> patterns;
-EXTERN vector<regex_t> comp_regex;
-EXTERN string dir_src;
-EXTERN string dir_dest;
-EXTERN struct st_flags flags;
-EXTERN size_t bytes_copied;
-EXTERN int verbose;
-EXTERN int files_copied;
-EXTERN int symlinks_copied;
-EXTERN int dirs_copied;
-EXTERN int xattr_copied;
-EXTERN int xattr_files;
-EXTERN int total_copied;
-EXTERN int unmatched_deleted;
-EXTERN int regex_type;
-EXTERN int errors;
-EXTERN int warnings;
+struct st_dir_stamp
+{
+	ino_t ino;
+	time_t mtime;
+	long mtime_ns;
+	time_t ctime;
+	long ctime_ns;
+
+	bool operator==(const st_dir_stamp &s) const
+	{
+		return ino == s.ino &&
+		       mtime == s.mtime && mtime_ns == s.mtime_ns &&
+		       ctime == s.ctime && ctime_ns == s.ctime_ns;
+	}
+};
+
+/* A file being copied. A thread claims a slot then sets used once the
+   path is in it. The seq is odd while the path is being written so the
+   progress thread can tell if it got a torn copy. */
+struct st_slot
+{
+	atomic<unsigned> seq;
+	atomic<bool> claimed;
+	atomic<bool> used;
+	char path[PATH_MAX];
+};
+
+/* Everything to do with one sync. The code doing the work finds it through
+   the thread local job pointer. */
+struct st_job: public SyncOptions, public SyncStats
+{
+	vector<regex_t> comp_regex;
+	SyncPool *pool;
+	unique_ptr<SyncPool> own_pool;
+	atomic<bool> stopped;
+	bool exit_on_stop;
+	int exit_code;
+	int tasks_running;
+	mutex job_mutex;
+	condition_variable job_cond;
+
+	// audit.cc
+	vector<string> audit_paths;
+	atomic<size_t> audit_next;
+	unsigned audit_seed;
+
+	// clone.cc
+	unordered_map<st_dedupe_key,string,st_dedupe_key_hash> dedupe_files;
+	unordered_map<off_t,vector<string>> dedupe_sizes;
+	mutex dedupe_mutex;
+
+	// filelist.cc
+	atomic<size_t> next_path;
+	map<string,bool> made_dirs;
+	mutex made_dirs_mutex;
+
+	// move.cc
+	unordered_multimap<st_move_key,string,st_move_key_hash> move_candidates;
+	unordered_set<string> move_paths;
+	vector<string> deferred_deletes;
+
+	// progress.cc
+	st_slot slots[PROGRESS_SLOTS];
+	thread progress_thread;
+	mutex progress_mutex;
+	condition_variable progress_cond;
+	bool progress_stop;
+	size_t total_bytes;
+	int total_items;
+	int listen_fd;
+
+	// treeckp.cc
+	unordered_map<string,st_dir_stamp> ckp_done;
+	FILE *ckp_fp;
+	time_t ckp_flushed;
+
+	st_job(const SyncOptions &options, SyncPool *sync_pool);
+	~st_job(void);
+};
+
+EXTERN thread_local st_job *job;
+EXTERN int log_format;
+
+// append.cc
+size_t appendFile(
+	char *src, char *dest, struct stat *src_stat, struct stat *dest_stat);
+
+// audit.cc
+void auditTrees(void);
+
+// bulk.cc
+int     bulkOpen(const char *path, int oflags, mode_t mode);
+char   *bulkBuffer(int num);
+void    bulkStart(int src_fd, int dest_fd, off_t size);
+ssize_t bulkRead(int fd, char *buff, size_t len);
+ssize_t bulkPread(int fd, char *buff, size_t len, off_t offset);
+ssize_t bulkWrite(int fd, char *buff, size_t len);
+void    bulkAdvance(int src_fd, int dest_fd, off_t offset, size_t len);
+bool    bulkFinish(int dest_fd, off_t size);
+
+// clone.cc
+int  cloneFile(int src_fd, int dest_fd);
+int  cloneRange(int src_fd, int dest_fd, off_t offset);
+void dedupeFile(char *path, struct stat *st, bool written);
 
 // copy.cc
 void copyFiles(string &src_dir, string &dest_dir, int depth);
+size_t copyFile(char *src, char *dest, struct stat *src_stat);
+void copyEntry(
+	const string &name,
+	string &src_path,
+	string &dest_path,
+	struct stat *src_stat, struct stat *dest_stat, int depth, bool recurse);
+void deleteUnmatched(
+	const string &name, string &dest_path, struct stat *dest_stat, int depth);
+bool makeDir(char *src, char *dest, struct stat *src_stat, int depth);
+void setSymbolicLink(
+	char *src_link,
+	char *src_target,
+	char *dest_link,
+	struct stat *src_stat, struct stat *dest_stat, int depth);
+bool copyMetaData(char *src, char *dest, struct stat *src_stat, bool symlink);
+void updateMetaData(
+	char *src,
+	char *dest, struct stat *src_stat, struct stat *dest_stat, int depth);
+string metaDataDiffs(struct stat *src_stat, struct stat *dest_stat);
+bool sameMTime(struct stat *src_stat, struct stat *dest_stat);
+bool sameXAttrs(char *path1, char *path2, bool symlink);
+bool sameContents(char *file1, char *file2);
+bool loadDir(string &dirname, map<string,struct stat> &files_list);
+void finishSync(void);
+void printStats(const SyncStats &stats);
+char *bytesSizeStr(size_t bytes);
+void logCopyStart(const string &line);
+void logCopyDone(const string &path, size_t bytes);
+bool logOneThread(void);
+
+// engine.cc
+bool jobInit(void);
+void jobStop(int code);
+void jobTasks(int num, function<void(void)> task);
+
+// filelist.cc
+void copyFileList(void);
+
+// hash.cc
+uint64_t hashBlock(const void *data, size_t len, uint64_t seed);
+bool     hashFile(const char *path, uint64_t &hash, vector<uint64_t> *blocks);
+
+// progress.cc
+void progressStart(void);
+void progressStop(void);
+void progressFile(const char *path);
+
+// remote.cc
+void remoteSend(const char *cmd);
+void remoteReceive(void);
+
+// treeckp.cc
+void treeCkpStart(void);
+bool treeCkpDone(const string &rel_path, struct stat *src_stat);
+void treeCkpSave(const string &rel_path, struct stat *src_stat);
+void treeCkpFinish(void);
+
+// shard.cc
+bool shardOwns(const string &rel_path, bool dir);
+void statsWrite(void);
+int  statsMerge(vector<string> &paths);
+
+// tune.cc
+void tuneStart(void);
+
+// layout.cc
+void layoutEntries(
+	const string &src_dir,
+	vector<map<string,struct stat>::iterator> &entries,
+	map<string,struct stat> &dest_files);
+void layoutList(void);
+bool layoutExtent(int fd, uint64_t &physical, uint32_t &flags);
+
+// linkdest.cc
+bool linkDest(
+	string &src_path, string &dest_path, struct stat *src_stat, int depth);
+
+// log.cc
+void logInit(int fd);
+void logShutdown(void);
+void logPrintf(const char *fmt, ...) __attribute__((format(printf,1,2)));
+void logReport(const char *fmt, ...) __attribute__((format(printf,1,2)));
+void logPuts(const char *str);
+void logFlush(void);
+
+// move.cc
+void scanMoves(void);
+bool moveFile(
+	string &src_path, string &dest_path, struct stat *src_stat, int depth);
+bool deferDelete(string &dest_path);
+void deleteDeferred(void);
 
 // names.cc
 map<string,struct stat>::iterator findName(
 	const string &name, map<string,struct stat> &names_list);
 bool nameMatched(const string &name);
+bool dirExcluded(const string &name, const string &rel_path);
 
@@ -0,0 +1,139 @@
+/*** 64 bit hash of a block of memory used for comparing file contents
+     without having both files to hand. This is xxHash64 which is fast and
+     good enough for spotting changed blocks, it is not cryptographic. ***/
+#include "globals.h"
+
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+#define PRIME4 0x85EBCA77C2B2AE63ULL
+#define PRIME5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+
+static inline uint64_t read64(const unsigned char *p)
+{
+	uint64_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+
+static inline uint32_t read32(const unsigned char *p)
+{
+	uint32_t v;
+	memcpy(&v,p,sizeof(v));
+	return v;
+}
+
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl(acc,31);
+	return acc * PRIME1;
+}
+
+
+static inline uint64_t merge64(uint64_t acc, uint64_t val)
+{
+	acc ^= round64(0,val);
+	return acc * PRIME1 + PRIME4;
+}
+
+
+
+
+uint64_t hashBlock(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	const unsigned char *end = p + len;
+	uint64_t h;
+
+	if (len >= 32)
+	{
+		const unsigned char *limit = end - 32;
+		uint64_t v1 = seed + PRIME1 + PRIME2;
+		uint64_t v2 = seed + PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME1;
+
+		do
+		{
+			v1 = round64(v1,read64(p));
+			v2 = round64(v2,read64(p+8));
+			v3 = round64(v3,read64(p+16));
+			v4 = round64(v4,read64(p+24));
+			p += 32;
+		} while(p <= limit);
+
+		h = rotl(v1,1) + rotl(v2,7) + rotl(v3,12) + rotl(v4,18);
+		h = merge64(h,v1);
+		h = merge64(h,v2);
+		h = merge64(h,v3);
+		h = merge64(h,v4);
+	}
+	else h = seed + PRIME5;
+
+	h += (uint64_t)len;
+
+	for(;p + 8 <= end;p += 8)
+	{
+		h ^= round64(0,read64(p));
+		h = rotl(h,27) * PRIME1 + PRIME4;
+	}
+	if (p + 4 <= end)
+	{
+		h ^= (uint64_t)read32(p) * PRIME1;
+		h = rotl(h,23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for(;p < end;++p)
+	{
+		h ^= (*p) * PRIME5;
+		h = rotl(h,11) * PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+
+
+
+/*** Hash a file in HASH_BLOCK sized blocks. The hash of the whole file is
+     the hash of the block hashes. If blocks isn't NULL the block hashes are
+     returned in it. ***/
+bool hashFile(const char *path, uint64_t &hash, vector<uint64_t> *blocks)
+{
+	vector<uint64_t> tmp;
+	char *buff = bulkBuffer(1);
+	off_t offset;
+	ssize_t len;
+	int fd;
+
+	if (!blocks) blocks = &tmp;
+	blocks->clear();
+
+	if ((fd = bulkOpen(path,O_RDONLY,0)) == -1) return false;
+	bulkStart(fd,-1,0);
+
+	for(offset=0;(len = bulkRead(fd,buff,HASH_BLOCK)) > 0;offset += len)
+	{
+		blocks->push_back(hashBlock(buff,len,0));
+		bulkAdvance(fd,-1,offset,len);
+	}
+	close(fd);
+	if (len == -1) return false;
+
+	hash = hashBlock(blocks->data(),blocks->size() * sizeof(uint64_t),0);
+	return true;
+}
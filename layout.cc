@@ -0,0 +1,159 @@
+/*** Disk layout ordering (-O). On a spinning disk copying in name order
+     sends the heads all over the platter. Instead the regular files in each
+     directory that look like they need copying, or all the paths in a file
+     list, are sorted by where their data starts on the disk before any of
+     them are read. FIEMAP gives that, if the filesystem can't say then
+     inode order is used which roughly follows allocation order on most
+     filesystems. Only the order changes, what gets copied doesn't. ***/
+#include "globals.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+
+bool layoutOrder(vector<string> &paths, vector<size_t> &order);
+
+
+/*** Put the regular files first in disk order followed by everything else
+     in name order. Files that are the same size in the destination will
+     probably be skipped so it's not worth looking them up. ***/
+void layoutEntries(
+	const string &src_dir,
+	vector<map<string,struct stat>::iterator> &entries,
+	map<string,struct stat> &dest_files)
+{
+	vector<map<string,struct stat>::iterator> files;
+	vector<map<string,struct stat>::iterator> rest;
+	map<string,struct stat>::iterator dest_it;
+	vector<string> paths;
+	vector<size_t> order;
+	bool by_extent;
+
+	for(auto &it: entries)
+	{
+		if (S_ISREG(it->second.st_mode) &&
+		    nameMatched(it->first) &&
+		    (job->flags.compare_contents ||
+		     (dest_it = findName(it->first,dest_files)) == dest_files.end() ||
+		     dest_it->second.st_size != it->second.st_size))
+		{
+			files.push_back(it);
+			paths.push_back(src_dir + "/" + it->first);
+		}
+		else rest.push_back(it);
+	}
+	if (files.size() < 2) return;
+
+	by_extent = layoutOrder(paths,order);
+	if (job->verbose == VERB_HIGH)
+	{
+		logPrintf("Ordering %lu files in \"%s\" by %s.\n",
+			files.size(),src_dir.c_str(),by_extent ? "extent" : "inode");
+	}
+	entries.clear();
+	for(size_t i: order) entries.push_back(files[i]);
+	entries.insert(entries.end(),rest.begin(),rest.end());
+}
+
+
+
+
+/*** Sort the file list before the workers start on it. They take paths in
+     turn so the reads stay roughly in order even with a few threads. ***/
+void layoutList(void)
+{
+	vector<string> paths;
+	vector<string> sorted;
+	vector<size_t> order;
+	bool by_extent;
+
+	if (job->file_list.size() < 2) return;
+
+	for(auto &rel_path: job->file_list)
+		paths.push_back(job->dir_src + "/" + rel_path);
+	by_extent = layoutOrder(paths,order);
+	if (job->verbose == VERB_HIGH)
+	{
+		logPrintf("Ordering %lu listed paths by %s.\n",
+			paths.size(),by_extent ? "extent" : "inode");
+	}
+	for(size_t i: order) sorted.push_back(std::move(job->file_list[i]));
+	job->file_list.swap(sorted);
+}
+
+
+
+
+/*** Sets order to the indexes of paths in disk order. Anything that isn't a
+     regular file we can open goes first in its original order. Returns
+     true if physical extents were used, false if inodes. ***/
+bool layoutOrder(vector<string> &paths, vector<size_t> &order)
+{
+	vector<uint64_t> extents(paths.size(),0);
+	vector<uint64_t> inodes(paths.size(),0);
+	struct stat fs;
+	bool by_extent = true;
+	uint32_t flags;
+	size_t i;
+	int fd;
+
+	for(i=0;i < paths.size() && !job->stopped;++i)
+	{
+		if ((fd = open(paths[i].c_str(),O_RDONLY | O_NOFOLLOW)) == -1)
+			continue;
+		if (fstat(fd,&fs) != -1 && S_ISREG(fs.st_mode))
+		{
+			inodes[i] = fs.st_ino;
+			if (by_extent && !layoutExtent(fd,extents[i],flags))
+				by_extent = false;
+		}
+		close(fd);
+	}
+
+	vector<uint64_t> &keys = (by_extent ? extents : inodes);
+
+	order.resize(paths.size());
+	for(i=0;i < order.size();++i) order[i] = i;
+	stable_sort(order.begin(),order.end(),
+		[&keys](size_t a, size_t b) { return keys[a] < keys[b]; });
+	return by_extent;
+}
+
+
+
+
+/*** Get the physical offset and flags of the first extent. Empty files and
+     ones the filesystem hasn't placed yet get 0. Returns false if the
+     filesystem doesn't do FIEMAP. ***/
+bool layoutExtent(int fd, uint64_t &physical, uint32_t &flags)
+{
+#ifdef FS_IOC_FIEMAP
+	alignas(fiemap) char buff[sizeof(fiemap) + sizeof(fiemap_extent)];
+	fiemap *fm = (fiemap *)buff;
+	fiemap_extent *extent = &fm->fm_extents[0];
+
+	bzero(buff,sizeof(buff));
+	fm->fm_start = 0;
+	fm->fm_length = FIEMAP_MAX_OFFSET;
+	fm->fm_extent_count = 1;
+
+	if (ioctl(fd,FS_IOC_FIEMAP,fm) == -1) return false;
+
+	flags = (fm->fm_mapped_extents ? extent->fe_flags : 0);
+	if (!fm->fm_mapped_extents ||
+	    (extent->fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC)))
+		physical = 0;
+	else
+		physical = extent->fe_physical;
+	return true;
+#else
+	(void)fd;
+	(void)physical;
+	(void)flags;
+	return false;
+#endif
+}
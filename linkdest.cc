@@ -0,0 +1,49 @@
+/*** Link dest mode (-L). When making a new snapshot of the source, files
+     that haven't changed since the previous snapshot are hard linked from
+     it instead of copied so each snapshot only costs what changed. A hard
+     link shares the metadata as well as the data so it's only done if the
+     previous copy's metadata is right too. Nothing is ever written through
+     a link as that would change the previous snapshot. ***/
+#include "globals.h"
+
+
+/*** Returns true if the destination was linked to the previous snapshot's
+     copy. False means it needs copying as normal. ***/
+bool linkDest(
+	string &src_path, string &dest_path, struct stat *src_stat, int depth)
+{
+	string prev_path = job->link_dest + src_path.substr(job->dir_src.size());
+	struct stat prev_stat;
+
+	if (lstat(prev_path.c_str(),&prev_stat) == -1 ||
+	    !S_ISREG(prev_stat.st_mode) ||
+	    prev_stat.st_size != src_stat->st_size) return false;
+
+	if (job->flags.copy_metadata && metaDataDiffs(src_stat,&prev_stat).size())
+		return false;
+	if (job->flags.copy_xattrs &&
+	    !sameXAttrs((char *)src_path.c_str(),(char *)prev_path.c_str(),false))
+		return false;
+	if (job->flags.compare_contents &&
+	    !sameContents((char *)src_path.c_str(),(char *)prev_path.c_str()))
+		return false;
+
+	if (link(prev_path.c_str(),dest_path.c_str()) == -1)
+	{
+		// Eg too many links or a different filesystem
+		if (job->verbose)
+		{
+			logPrintf("%d: WARNING: Can't link \"%s\" to \"%s\", copying instead: %s\n",
+				depth,dest_path.c_str(),prev_path.c_str(),strerror(errno));
+		}
+		++job->warnings;
+		return false;
+	}
+	if (job->verbose == VERB_HIGH)
+	{
+		logPrintf("%d: Linked \"%s\" to unchanged \"%s\".\n",
+			depth,dest_path.c_str(),prev_path.c_str());
+	}
+	++job->files_linked;
+	return true;
+}
@@ -0,0 +1,352 @@
+/*** Buffered logging. Messages are formatted into a per thread buffer which
+     is handed to a background writer thread in large batches so that slow
+     terminals or pipes don't hold up the copying. If the writer falls too
+     far behind then batches are dropped, apart from any errors or reports
+     in them, and a count given at the end. ***/
+#include "globals.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <stdarg.h>
+#include <time.h>
+
+#define LOG_BATCH       65536
+#define LOG_MAX_PENDING 16000000
+#define LOG_FLUSH_MSECS 200
+
+struct st_logbuff
+{
+	string text;
+	string line;
+	struct timespec last_submit;
+
+	st_logbuff() { clock_gettime(CLOCK_MONOTONIC,&last_submit); }
+	~st_logbuff();
+};
+
+static thread_local st_logbuff logbuff;
+static thread_local bool logbuff_gone;
+static mutex log_mutex;
+static condition_variable log_cond;
+static deque<string> log_queue;
+static thread log_thread;
+static size_t log_pending;
+static size_t log_dropped;
+static int log_fd = -1;
+static bool log_stop;
+
+void   logFormat(bool keep, const char *fmt, va_list args);
+void   logAdd(const char *str, size_t len, bool keep);
+void   logWriter(void);
+void   logSubmit(st_logbuff &lb, bool all, bool keep);
+void   logKeepErrors(string &text);
+void   logAddJSON(st_logbuff &lb, const char *str, size_t len);
+void   logWrite(const char *str, size_t len);
+
+
+/*** Start the writer thread. Before this is called anything logged is
+     written straight out. Exiting via exit() flushes the log. ***/
+void logInit(int fd)
+{
+	// Make sure anything already printed with stdio comes out first
+	fflush(stdout);
+	log_fd = fd;
+	log_stop = false;
+	log_thread = thread(logWriter);
+	atexit(logShutdown);
+}
+
+
+
+
+/*** Flush everything and stop the writer thread ***/
+void logShutdown(void)
+{
+	char str[100];
+
+	if (!log_thread.joinable()) return;
+
+	// On exit() this threads buffer will already have been submitted
+	if (!logbuff_gone) logSubmit(logbuff,true,false);
+	{
+		lock_guard<mutex> lock(log_mutex);
+		log_stop = true;
+	}
+	log_cond.notify_one();
+	log_thread.join();
+
+	if (log_dropped)
+	{
+		snprintf(str,sizeof(str),
+			"WARNING: %lu log lines dropped as output was too slow.\n",
+			log_dropped);
+		logWrite(str,strlen(str));
+	}
+}
+
+
+
+
+void logPrintf(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args,fmt);
+	logFormat(false,fmt,args);
+	va_end(args);
+}
+
+
+
+
+/*** For results such as audit differences which must never be dropped
+     however far behind the writer is ***/
+void logReport(const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args,fmt);
+	logFormat(true,fmt,args);
+	va_end(args);
+}
+
+
+
+
+void logFormat(bool keep, const char *fmt, va_list args)
+{
+	char str[1000];
+	char *big = NULL;
+	va_list args2;
+	int len;
+
+	va_copy(args2,args);
+	len = vsnprintf(str,sizeof(str),fmt,args);
+	if (len >= (int)sizeof(str))
+	{
+		big = new char[len+1];
+		vsnprintf(big,len+1,fmt,args2);
+	}
+	va_end(args2);
+
+	unique_ptr<char[]> ubig(big);
+	if (len > 0) logAdd(big ? big : str,len,keep);
+}
+
+
+
+
+void logPuts(const char *str)
+{
+	logAdd(str,strlen(str),false);
+	logAdd("\n",1,false);
+}
+
+
+
+
+/*** Add text to this threads buffer and pass it to the writer if its got
+     big enough, it hasn't been passed for a while or it must be kept ***/
+void logAdd(const char *str, size_t len, bool keep)
+{
+	struct timespec now;
+	st_logbuff &lb = logbuff;
+
+	if (!log_thread.joinable())
+	{
+		logWrite(str,len);
+		return;
+	}
+	if (log_format == LOG_JSON)
+		logAddJSON(lb,str,len);
+	else
+		lb.text.append(str,len);
+
+	clock_gettime(CLOCK_MONOTONIC,&now);
+	if (keep ||
+	    lb.text.size() >= LOG_BATCH ||
+	    (now.tv_sec - lb.last_submit.tv_sec) * 1000 +
+	    (now.tv_nsec - lb.last_submit.tv_nsec) / 1000000 >= LOG_FLUSH_MSECS)
+	{
+		logSubmit(lb,false,keep);
+		lb.last_submit = now;
+	}
+}
+
+
+
+
+/*** Complete lines become one JSON record each. Partial lines are held
+     until the rest arrives. ***/
+void logAddJSON(st_logbuff &lb, const char *str, size_t len)
+{
+	struct timespec ts;
+	char hdr[50];
+	const char *end = str + len;
+	const char *nl;
+
+	for(;str < end;str = nl + 1)
+	{
+		if (!(nl = (const char *)memchr(str,'\n',end - str)))
+		{
+			lb.line.append(str,end - str);
+			return;
+		}
+		lb.line.append(str,nl - str);
+
+		clock_gettime(CLOCK_REALTIME,&ts);
+		snprintf(hdr,sizeof(hdr),"{\"time\":%ld.%03ld,\"msg\":\"",
+			(long)ts.tv_sec,ts.tv_nsec / 1000000);
+		lb.text += hdr;
+		for(unsigned char c: lb.line)
+		{
+			if (c == '"' || c == '\\')
+			{
+				lb.text += '\\';
+				lb.text += c;
+			}
+			else if (c < 0x20)
+			{
+				snprintf(hdr,sizeof(hdr),"\\u%04x",c);
+				lb.text += hdr;
+			}
+			else lb.text += c;
+		}
+		lb.text += "\"}\n";
+		lb.line.clear();
+	}
+}
+
+
+
+
+/*** Pass on this thread's text including any partial line. Called before
+     something that could take a while, eg copying a big file, so the start
+     of its line shows up straight away. ***/
+void logFlush(void)
+{
+	if (logbuff_gone) return;
+	logSubmit(logbuff,true,false);
+	clock_gettime(CLOCK_MONOTONIC,&logbuff.last_submit);
+}
+
+
+
+
+/*** Hand the buffer to the writer unless it's too far behind in which case
+     drop it except for any errors, or keep all of it if keep is set. We
+     never wait on the writer. Unless all is set only complete lines are
+     passed so lines from different threads don't get mixed. ***/
+void logSubmit(st_logbuff &lb, bool all, bool keep)
+{
+	string rest;
+	size_t len;
+
+	if (!lb.text.size() || !log_thread.joinable()) return;
+	if (!all)
+	{
+		if ((len = lb.text.rfind('\n')) == string::npos) return;
+		rest = lb.text.substr(++len);
+		lb.text.resize(len);
+	}
+	else len = lb.text.size();
+	{
+		lock_guard<mutex> lock(log_mutex);
+		if (!keep && log_pending + len > LOG_MAX_PENDING)
+		{
+			logKeepErrors(lb.text);
+			if (!lb.text.size())
+			{
+				lb.text = rest;
+				return;
+			}
+			len = lb.text.size();
+		}
+		log_pending += len;
+		log_queue.push_back(move(lb.text));
+	}
+	lb.text = rest;
+	lb.text.reserve(LOG_BATCH);
+	log_cond.notify_one();
+}
+
+
+
+
+/*** Cut the text down to just the lines with errors in them, which can be
+     after the start of a "Copying..." line, and count the rest as
+     dropped. Must be called with the mutex held. ***/
+void logKeepErrors(string &text)
+{
+	string errors;
+	const char *line;
+	const char *end = text.data() + text.size();
+	const char *nl;
+
+	for(line=text.data();line < end;line = nl + 1)
+	{
+		if (!(nl = (const char *)memchr(line,'\n',end - line))) nl = end;
+		if (memmem(line,nl - line,"ERROR:",6))
+			errors.append(line,min(nl + 1,end) - line);
+		else
+			++log_dropped;
+	}
+	text.swap(errors);
+}
+
+
+
+
+/*** Threads exiting pass on whatever they have left ***/
+st_logbuff::~st_logbuff()
+{
+	logSubmit(*this,true,false);
+	logbuff_gone = true;
+}
+
+
+
+
+void logWriter(void)
+{
+	deque<string> batch;
+
+	unique_lock<mutex> lock(log_mutex);
+	while(true)
+	{
+		log_cond.wait(lock,[] { return log_stop || log_queue.size(); });
+		if (!log_queue.size() && log_stop) break;
+
+		batch.swap(log_queue);
+		lock.unlock();
+		for(auto &text: batch) logWrite(text.c_str(),text.size());
+		lock.lock();
+
+		for(auto &text: batch) log_pending -= text.size();
+		batch.clear();
+	}
+}
+
+
+
+
+void logWrite(const char *str, size_t len)
+{
+	ssize_t wrote;
+	int fd = (log_fd == -1 ? STDOUT_FILENO : log_fd);
+
+	for(;len;str += wrote,len -= wrote)
+	{
+		if ((wrote = write(fd,str,len)) == -1)
+		{
+			if (errno == EINTR)
+			{
+				wrote = 0;
+				continue;
+			}
+			return;
+		}
+	}
+}
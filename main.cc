@@ -6,22 +6,29 @@
 
  Original version written winter 2018-2019
 ******************************************************************************/
-#define MAINFILE
 #include "globals.h"
 #include "build_date.h"
 
+static SyncOptions opts;
+static string remote_cmd;
+static vector<string> merge_paths;
+
 void parseCmdLine(int argc, char **argv);
 void version(void);
-void init(void);
+int  remoteMain(void);
 
 
 int main(int argc, char **argv)
 {
 	parseCmdLine(argc,argv);
-	if (verbose == VERB_HIGH) version();
-	init();
-	copyFiles(dir_src,dir_dest,1);
-	return 0;
+	// In receiver mode stdout is the link back to the sender
+	if (opts.verbose == VERB_HIGH && !opts.flags.receiver) version();
+	logInit(opts.flags.receiver ? STDERR_FILENO : STDOUT_FILENO);
+	if (merge_paths.size()) return statsMerge(merge_paths);
+	if (opts.flags.receiver || remote_cmd != "") return remoteMain();
+
+	SyncEngine engine(opts);
+	return engine.run();
 }
 
 
@@ -34,12 +41,7 @@ void parseCmdLine(int argc, char **argv)
 
 	if (argc < 2) goto USAGE;
 
-	verbose = VERB_NORMAL;
-	regex_type = REGEX_NONE;
-
-	bzero(&flags,sizeof(flags));
-	flags.stop_on_error = 1;
-	flags.copy_metadata = 1;
+	log_format = LOG_TEXT;
 
 	for(i=1;i < argc;++i)
 	{
@@ -48,39 +50,72 @@ void parseCmdLine(int argc, char **argv)
 
 		switch(c)
 		{
+		case 'a':
+			opts.flags.auto_tune = 1;
+			continue;
+		case 'A':
+			opts.flags.audit = 1;
+			continue;
 		case 'c':
-			flags.compare_contents = 1;
+			opts.flags.compare_contents = 1;
+			continue;
+		case 'D':
+			opts.flags.dedupe = 1;
 			continue;
 		case 'e':
-			flags.stop_on_error = 0;
+			opts.flags.stop_on_error = 0;
+			continue;
+		case 'g':
+			opts.flags.append = 1;
 			continue;
 		case 'h':
 			goto USAGE;
 		case 'i':
-			flags.ignore_case = 1;
+			opts.flags.ignore_case = 1;
+			continue;
+		case 'j':
+			log_format = LOG_JSON;
+			continue;
+		case 'k':
+			opts.flags.bulk_io = 1;
+			continue;
+		case 'K':
+			opts.flags.clone = 1;
 			continue;
 		case 'm':
-			flags.copy_metadata = 0;
+			opts.flags.copy_metadata = 0;
+			continue;
+		case 'M':
+			opts.flags.detect_moves = 1;
+			continue;
+		case 'O':
+			opts.flags.layout_order = 1;
 			continue;
 		case 'o':
-			flags.copy_dot_files = 1;
+			opts.flags.copy_dot_files = 1;
+			continue;
+		case 'T':
+			opts.flags.shard_subtree = 1;
 			continue;
 		case 'u':
-			flags.delete_unmatched = 1;
+			opts.flags.delete_unmatched = 1;
 			continue;
 		case 'v':
 			version();
 			exit(0);
 		case 'x':
-			flags.copy_xattrs = 1;
+			opts.flags.copy_xattrs = 1;
+			continue;
+		case 'z':
+			opts.flags.receiver = 1;
 			continue;
 		}
 		if (++i == argc) goto USAGE;
 		switch(c)
 		{
 		case 'b':
-			verbose = atoi(argv[i]);
-			if (verbose < VERB_NONE || verbose > VERB_HIGH)
+			opts.verbose = atoi(argv[i]);
+			if (opts.verbose < VERB_NONE || opts.verbose > VERB_HIGH)
 			{
 				puts("ERROR: Verbosity must be 1 or 2.");
 				exit(1);
@@ -88,35 +123,201 @@ void parseCmdLine(int argc, char **argv)
 			break;
 		case 'r':
 			if (!strcasecmp(argv[i],"partial"))
-				regex_type = REGEX_PARTIAL;
+				opts.regex_type = REGEX_PARTIAL;
 			else if (!strcasecmp(argv[i],"full"))
-				regex_type = REGEX_FULL;
+				opts.regex_type = REGEX_FULL;
 			else goto USAGE;
 			break;
 		case 's':
-			dir_src = argv[i];
+			opts.dir_src = argv[i];
 			break;
 		case 'd':
-			dir_dest = argv[i];
+			opts.dir_dest = argv[i];
+			break;
+		case 'R':
+			remote_cmd = argv[i];
 			break;
 		case 'p':
-			patterns.insert(argv[i]);
+			opts.patterns.insert(argv[i]);
+			break;
+		case 'f':
+			if (!opts.loadFileList(argv[i]))
+			{
+				printf("ERROR: Can't load file list from \"%s\": %s\n",
+					argv[i],strerror(errno));
+				exit(1);
+			}
+			break;
+		case 'w':
+			if ((opts.threads = atoi(argv[i])) < 1)
+			{
+				puts("ERROR: The number of threads must be at least 1.");
+				exit(1);
+			}
+			break;
+		case 'C':
+			opts.checkpoint_path = argv[i];
+			break;
+		case 'H':
+			if (sscanf(argv[i],"%d/%d",&opts.shard_index,&opts.shard_count) != 2 ||
+			    opts.shard_count < 1 ||
+			    opts.shard_index < 1 || opts.shard_index > opts.shard_count)
+			{
+				puts("ERROR: The shard must be given as <n>/<total> with n from 1 to the total.");
+				exit(1);
+			}
+			--opts.shard_index;
+			break;
+		case 'W':
+			opts.stats_file = argv[i];
+			break;
+		case 'L':
+			opts.link_dest = argv[i];
+			break;
+		case 'G':
+			merge_paths.push_back(argv[i]);
+			break;
+		case 'N':
+			opts.audit_sample = atoi(argv[i]);
+			if (opts.audit_sample < 1 || opts.audit_sample > 100)
+			{
+				puts("ERROR: The sample percentage must be from 1 to 100.");
+				exit(1);
+			}
+			break;
+		case 'P':
+			if ((opts.progress_secs = atoi(argv[i])) < 1)
+			{
+				puts("ERROR: The progress interval must be at least 1 second.");
+				exit(1);
+			}
+			break;
+		case 'S':
+			opts.status_path = argv[i];
+			break;
+		case 'X':
+			opts.addDirRule(argv[i],false);
+			break;
+		case 'I':
+			opts.addDirRule(argv[i],true);
+			break;
+		case 'E':
+			if (!opts.loadDirRules(argv[i]))
+			{
+				printf("ERROR: Can't load directory rules from \"%s\": %s\n",
+					argv[i],strerror(errno));
+				exit(1);
+			}
+			break;
+		case 't':
+			if (atoi(argv[i]) < 0)
+			{
+				puts("ERROR: The resume threshold cannot be negative.");
+				exit(1);
+			}
+			opts.resume_size = (size_t)atoi(argv[i]) * 1000000;
 			break;
 		default:
 			goto USAGE;
 		}
 	}
-	if (dir_src == "" || dir_dest == "")
+	// Status output needs an interval
+	if (opts.status_path != "" && !opts.progress_secs)
+		opts.progress_secs = DEFAULT_PROGRESS;
+
+	// Merging doesn't sync anything
+	if (merge_paths.size()) return;
+
+	if (opts.flags.receiver)
+	{
+		if (opts.dir_dest == "")
+		{
+			puts("ERROR: The -d argument is required with -z.");
+			exit(1);
+		}
+		return;
+	}
+	if (remote_cmd != "")
+	{
+		if (opts.dir_src == "" || opts.dir_dest != "")
+		{
+			puts("ERROR: The -s argument is required with -R and -d is given to the receiver.");
+			exit(1);
+		}
+		if (opts.flags.file_list ||
+		    opts.flags.copy_xattrs ||
+		    opts.flags.detect_moves ||
+		    opts.resume_size ||
+		    opts.progress_secs ||
+		    opts.checkpoint_path != "" ||
+		    opts.flags.auto_tune ||
+		    opts.flags.clone ||
+		    opts.flags.dedupe ||
+		    opts.flags.layout_order ||
+		    opts.flags.audit ||
+		    opts.shard_count ||
+		    opts.stats_file != "" ||
+		    opts.link_dest != "" || opts.flags.append)
+		{
+			puts("ERROR: The -a, -A, -C, -D, -f, -g, -H, -K, -L, -M, -O, -P, -S, -t, -W and -x options cannot be used with -R.");
+			exit(1);
+		}
+		return;
+	}
+	if (opts.dir_src == "" || opts.dir_dest == "")
 	{
 		puts("ERROR: The -s and -d arguments are required.");
 		exit(1);
 	}
-	if (flags.ignore_case && regex_type != REGEX_NONE)
+	if (opts.flags.file_list && opts.flags.detect_moves)
+	{
+		puts("ERROR: The -f and -M options are mutually exclusive.");
+		exit(1);
+	}
+	if (opts.shard_count && (opts.flags.detect_moves || opts.flags.audit))
+	{
+		puts("ERROR: The -H option cannot be used with -A or -M.");
+		exit(1);
+	}
+	if (opts.flags.shard_subtree && !opts.shard_count)
+	{
+		puts("ERROR: The -T option can only be used with -H.");
+		exit(1);
+	}
+	if (opts.link_dest != "" && (opts.flags.detect_moves || opts.flags.audit))
+	{
+		puts("ERROR: The -L option cannot be used with -A or -M.");
+		exit(1);
+	}
+	if (opts.flags.file_list && opts.checkpoint_path != "")
+	{
+		puts("ERROR: The -f and -C options are mutually exclusive.");
+		exit(1);
+	}
+	if (opts.flags.audit &&
+	    (opts.flags.auto_tune ||
+	     opts.flags.clone ||
+	     opts.flags.dedupe ||
+	     opts.flags.delete_unmatched ||
+	     opts.flags.detect_moves ||
+	     opts.flags.file_list ||
+	     opts.resume_size ||
+	     opts.progress_secs || opts.checkpoint_path != ""))
+	{
+		puts("ERROR: The -a, -C, -D, -f, -K, -M, -P, -S, -t and -u options cannot be used with -A.");
+		exit(1);
+	}
+	if (opts.audit_sample && !opts.flags.audit)
+	{
+		puts("ERROR: The -N option can only be used with -A.");
+		exit(1);
+	}
+	if (opts.flags.ignore_case && opts.regex_type != REGEX_NONE)
 	{
 		puts("ERROR: The -i and -r options are mutually exclusive.");
 		exit(1);
 	}
-	if (!dir_dest.find(dir_src))
+	if (!opts.dir_dest.find(opts.dir_src))
 	{
 		puts("ERROR: The destination directory is the same or a sub directory of the source directory.");
 		exit(1);
@@ -128,32 +329,127 @@ void parseCmdLine(int argc, char **argv)
 	       "       -s <source dir>\n"
 	       "       -d <destination dir>\n"
 	       "      [-p <pattern to match>] : Wildcard by default, regex if -r option given.\n"
+	       "      [-X <dir pattern>]      : Don't descend into directories matching the\n"
+	       "                                pattern. If the pattern contains a '/' it\n"
+	       "                                is matched against the path relative to the\n"
+	       "                                source dir, eg \"/build\", else the name.\n"
+	       "      [-I <dir pattern>]      : Do descend into matching directories even if\n"
+	       "                                an earlier -X pattern matched them.\n"
+	       "      [-E <file>]             : Load -X patterns from the file, one per line.\n"
+	       "                                Lines starting with '!' are -I patterns.\n"
+	       "      [-f <file>]             : Only sync the paths, relative to the source\n"
+	       "                                dir, listed in the file instead of scanning\n"
+	       "                                both trees. Paths are newline or NUL\n"
+	       "                                separated. Use \"-\" for stdin. Paths\n"
+	       "                                containing \"..\" are ignored.\n"
+	       "      [-w <threads>]          : Number of worker threads. Default = %d.\n"
+	       "      [-C <file>]             : Record finished directories in the checkpoint\n"
+	       "                                file. If a run is interrupted the next run\n"
+	       "                                with the same file skips those that haven't\n"
+	       "                                changed. Deleted when a run completes.\n"
+	       "      [-P <seconds>]          : Scan first to find how much there is to do\n"
+	       "                                then report progress, rate and ETA to stderr\n"
+	       "                                every so many seconds.\n"
+	       "      [-S <file>]             : Write the progress as JSON to the file instead.\n"
+	       "                                If the file is \"unix:<path>\" then it is sent\n"
+	       "                                to anything connecting to that unix socket.\n"
+	       "                                Default interval = %d seconds.\n"
+	       "      [-L <dir>]              : Previous snapshot of the source. Files that\n"
+	       "                                are the same there (size, mode, owner and\n"
+	       "                                mtime, and contents if -c) are hard linked\n"
+	       "                                from it instead of copied.\n"
+	       "      [-H <n>/<total>]        : Only do shard n of total so that many runs,\n"
+	       "                                eg on different machines, can share a sync.\n"
+	       "                                Files are split by a hash of their path.\n"
+	       "                                Every shard creates the directories. Read\n"
+	       "                                only ones are left writable as other shards\n"
+	       "                                may not be done with them, run once without\n"
+	       "                                -H when they all are to set their metadata.\n"
+	       "      [-W <file>]             : Write the counts to the file when done.\n"
+	       "      [-G <file>]             : Add up the counts in files written by -W,\n"
+	       "                                eg by each shard, print them and exit. Can\n"
+	       "                                be given more than once.\n"
 	       "      [-r partial/full]       : Partial or full regex matching. For partial\n"
 	       "                                only some of the name needs to match the\n"
 	       "                                pattern, for full the whole name must match.\n"
 	       "      [-b <verbosity level>]  : %d to %d. Default = %d.\n"
+	       "      [-t <megabytes>]        : Files of this size or larger are copied into\n"
+	       "                                a temporary file next to the destination\n"
+	       "                                with a checkpoint so that an interrupted copy\n"
+	       "                                carries on from where it stopped next time.\n"
+	       "                                The copy is then renamed into place. The\n"
+	       "                                source is trusted to be unchanged if its\n"
+	       "                                size, mtime & inode match. Default = off.\n"
+	       "      [-a]                    : Auto tune. Probe the source and destination\n"
+	       "                                to pick the copy method, buffer size, threads,\n"
+	       "                                readahead and syncing. Cached per device pair\n"
+	       "                                in ~/.filesync_tune. -w overrides the threads.\n"
+	       "      [-N <percent>]          : With -A only compare the contents of this\n"
+	       "                                percentage of files, picked at random.\n"
+	       "      [-A]                    : Audit. Copy nothing but report every missing,\n"
+	       "                                extra, type, size, content and metadata\n"
+	       "                                difference, one per line. Contents of same\n"
+	       "                                sized files are compared by -w threads.\n"
+	       "                                Exits with 1 if anything differs.\n"
 	       "      [-c]                    : Compare file contents, not just size. This\n"
 	       "                                might be very slow for large files.\n"
+	       "      [-D]                    : Dedupe. Files in the destination that are\n"
+	       "                                copied or already up to date and have the\n"
+	       "                                same contents as another one share its\n"
+	       "                                storage. Needs btrfs, XFS or similar.\n"
 	       "      [-e]                    : Do NOT stop on errors.\n"
+	       "      [-g]                    : Growing files. If the destination is shorter\n"
+	       "                                than the source and its start and end match\n"
+	       "                                the source then only the new data is copied\n"
+	       "                                onto the end. For logs and journals.\n"
 	       "      [-h]                    : Show this usage.\n"
 	       "      [-i]                    : Ignore case in names when not using regex.\n"
 	       "                                Meant for OSX which has a case insensitive\n"
 	       "                                file system by default.\n"
+	       "      [-j]                    : Log in JSON lines format.\n"
+	       "      [-k]                    : Bulk I/O mode. Bypass or drop behind the page\n"
+	       "                                cache so the sync doesn't evict other data,\n"
+	       "                                and preallocate destination files.\n"
+	       "      [-K]                    : Clone files instead of copying them if the\n"
+	       "                                source and destination are on the same copy\n"
+	       "                                on write filesystem, eg btrfs or XFS. Falls\n"
+	       "                                back to copying if they're not.\n"
 	       "      [-m]                    : Do NOT copy standard file metadata. ie: mode,\n"
 	       "                                user & group id, access and modification times.\n"
+	       "      [-M]                    : Detect files that have been moved or renamed\n"
+	       "                                in the source by size, modification time and\n"
+	       "                                contents and move the old copy in the\n"
+	       "                                destination instead of copying it. Without\n"
+	       "                                -u it's only used with -K, to clone from.\n"
+	       "      [-O]                    : Copy the files in each directory, or the\n"
+	       "                                file list, in the order their data is on the\n"
+	       "                                source disk to cut down on seeking. Worth it\n"
+	       "                                for spinning disks. On with -a if the source\n"
+	       "                                is one.\n"
 	       "      [-o]                    : Copy (and delete if -l) dot files and\n"
 	       "                                directories. eg: .profile\n"
+	       "      [-T]                    : With -H split by top level subtree instead\n"
+	       "                                of by file.\n"
 	       "      [-u]                    : Delete/unlink files (not dirs) in destination\n"
 	       "                                that don't exist in the source but only if\n"
 	       "                                they're in dirs that DO exist in the source.\n"
 	       "      [-v]                    : Print version and exit.\n"
 	       "      [-x]                    : Copy extended attributes if possible. If it\n"
 	       "                                fails a warning is given, not a fatal error.\n"
+	       "      [-R <command>]          : Sync to a receiver at the other end of the\n"
+	       "                                command instead of to -d, eg:\n"
+	       "                                -R \"ssh host filesync -z -d /backup\"\n"
+	       "                                Only changed data is sent. The -c option\n"
+	       "                                compares files in blocks at each end.\n"
+	       "      [-z]                    : Run as the receiver for -R using stdin and\n"
+	       "                                stdout. Only -d is needed, other options come\n"
+	       "                                from the sender.\n"
 	       "Note: The -p argument restricts files and symlinks copied to those that match\n"
 	       "      the given pattern(s). The option must be used once for each pattern.\n"
 	       "      The patterns use '*' and '?' to match unless the regular expression -r\n"
 	       "      option is given.\n",
-		argv[0],VERB_NONE,VERB_HIGH,VERB_NORMAL);
+		argv[0],
+		DEFAULT_THREADS,DEFAULT_PROGRESS,VERB_NONE,VERB_HIGH,VERB_NORMAL);
 	exit(1);
 }
 
@@ -163,7 +459,7 @@ void parseCmdLine(int argc, char **argv)
 void version(void)
 {
 	puts("\n*** FILESYNC ***\n");
-	puts("Copyright (C) Neil Robertson 2021-2024\n");
+	puts("Copyright (C) Neil Robertson 2021-2026\n");
 	printf("Version   : %s\n",VERSION);
 	printf("Build date: %s\n\n",BUILD_DATE);
 }
@@ -171,35 +467,19 @@ void version(void)
 
 
 
-void init(void)
+/*** The remote modes run in this process with a job of their own. The
+     protocol can't recover from errors so they end the process. ***/
+int remoteMain(void)
 {
-	regex_t regex;
-	char errstr[100];
-	int err;
-
-	bytes_copied = 0;
-	files_copied = 0;
-	symlinks_copied = 0;
-	dirs_copied = 0;
-	xattr_copied = 0;
-	xattr_files = 0;
-	total_copied = 0;
-	unmatched_deleted = 0;
-	errors = 0;
-	warnings = 0;
-
-	if (regex_type != REGEX_NONE)
-	{
-		for(auto pat: patterns)
-		{
-			if ((err = regcomp(
-				&regex,pat.c_str(),REG_EXTENDED)))
-			{
-				regerror(err,&regex,errstr,sizeof(errstr));
-				printf("ERROR: Invalid regex: %s\n",errstr);
-				exit(1);
-			}
-			comp_regex.push_back(regex);
-		}
-	}
+	st_job remote_job(opts,NULL);
+
+	job = &remote_job;
+	job->exit_on_stop = true;
+	if (!jobInit()) return job->exit_code;
+
+	if (opts.flags.receiver)
+		remoteReceive();
+	else
+		remoteSend(remote_cmd.c_str());
+	return 0;
 }
@@ -0,0 +1,227 @@
+/*** Move detection (-M). Before copying, both trees are scanned and any
+     files in the destination that no longer exist in the source at the same
+     place are indexed by size and mtime. When a new source file is about to
+     be copied the index is checked and if a match with the same contents
+     is found it's renamed into place instead. Without -u nothing is removed
+     from the destination so with -K it's cloned from there instead, and
+     otherwise it's simply copied from the source as checking the contents
+     would only add to the I/O. With -u the deletion of indexed files is put
+     off until the end in case they're needed. Only used when walking the
+     trees so it's single threaded. ***/
+#include "globals.h"
+
+#define MOVE_MIN_SIZE 1
+
+void scanMoveDir(string &src_dir, string &dest_dir, bool src_exists);
+void addCandidate(string &path, struct stat *st);
+st_move_key moveKey(struct stat *st);
+
+
+size_t st_move_key_hash::operator()(const st_move_key &k) const
+{
+	return hashBlock(&k,sizeof(k),0);
+}
+
+
+
+
+/*** Build the index of destination files that might have been moved ***/
+void scanMoves(void)
+{
+	// Nothing can be saved without renaming or cloning
+	if (!job->flags.delete_unmatched && !job->flags.clone) return;
+
+	scanMoveDir(job->dir_src,job->dir_dest,true);
+	if (job->verbose == VERB_HIGH)
+	{
+		logPrintf("Move detection: %lu candidate files.\n",
+			job->move_candidates.size());
+	}
+}
+
+
+
+
+/*** Walk both trees together. Every regular file in the destination that
+     isn't in the source is a candidate including everything under
+     destination directories that are no longer in the source. ***/
+void scanMoveDir(string &src_dir, string &dest_dir, bool src_exists)
+{
+	map<string,struct stat> src_files;
+	map<string,struct stat> dest_files;
+	map<string,struct stat>::iterator src_it;
+	string src_path;
+	string dest_path;
+	bool sub_exists;
+
+	if (src_exists) loadDir(src_dir,src_files);
+	if (!loadDir(dest_dir,dest_files)) return;
+
+	for(auto &[name,dest_stat]: dest_files)
+	{
+		src_it = (src_exists ? findName(name,src_files) : src_files.end());
+		dest_path = dest_dir + "/" + name;
+
+		switch(dest_stat.st_mode & S_IFMT)
+		{
+		case S_IFREG:
+			if (src_it == src_files.end() && nameMatched(name))
+				addCandidate(dest_path,&dest_stat);
+			break;
+
+		case S_IFDIR:
+			sub_exists = (src_it != src_files.end() &&
+			              (src_it->second.st_mode & S_IFMT) == S_IFDIR);
+			src_path = src_dir + "/" + name;
+			if (sub_exists &&
+			    job->dir_rules.size() &&
+			    dirExcluded(name,src_path.substr(job->dir_src.size())))
+			{
+				continue;
+			}
+			scanMoveDir(src_path,dest_path,sub_exists);
+			break;
+		}
+	}
+}
+
+
+
+
+void addCandidate(string &path, struct stat *st)
+{
+	if (st->st_size < MOVE_MIN_SIZE) return;
+	job->move_candidates.emplace(moveKey(st),path);
+	job->move_paths.insert(path);
+}
+
+
+
+
+/*** Without metadata being copied the mtimes won't match so it's down to
+     size and contents ***/
+st_move_key moveKey(struct stat *st)
+{
+	st_move_key key;
+
+	key.size = st->st_size;
+	key.mtime = (job->flags.copy_metadata ? st->st_mtime : 0);
+	return key;
+}
+
+
+
+
+/*** Called instead of copying a new file. A candidate must hash the same as
+     the source as the size and mtime alone could be a coincidence. With -u
+     it's renamed into place, otherwise the old file has to stay so with -K
+     it's cloned from it. Returns true if either was done. ***/
+bool moveFile(string &src_path, string &dest_path, struct stat *src_stat, int depth)
+{
+	uint64_t src_hash;
+	uint64_t hash;
+	string cand;
+	size_t bytes;
+	bool src_hashed = false;
+
+	if (!job->move_candidates.size() || src_stat->st_size < MOVE_MIN_SIZE) return false;
+	if (!job->flags.delete_unmatched && !job->flags.clone) return false;
+
+	auto range = job->move_candidates.equal_range(moveKey(src_stat));
+
+	for(auto it=range.first;it != range.second;++it)
+	{
+		if (!src_hashed)
+		{
+			if (!hashFile(src_path.c_str(),src_hash,NULL)) return false;
+			src_hashed = true;
+		}
+		if (!hashFile(it->second.c_str(),hash,NULL) || hash != src_hash)
+			continue;
+
+		cand = it->second;
+		if (!job->flags.delete_unmatched)
+		{
+			if (job->verbose)
+			{
+				logCopyStart(to_string(depth) +
+					": Copying moved file \"" + cand +
+					"\" to \"" + dest_path + "\"");
+			}
+			bytes = copyFile(
+				(char *)cand.c_str(),(char *)dest_path.c_str(),src_stat);
+			if ((long)bytes == -1) return true;
+
+			// The xattributes came from the old file
+			copyMetaData(
+				(char *)src_path.c_str(),
+				(char *)dest_path.c_str(),src_stat,false);
+			if (job->verbose) logCopyDone(dest_path,bytes);
+			return true;
+		}
+		if (rename(cand.c_str(),dest_path.c_str()) == -1)
+		{
+			// Eg different filesystems within the destination. Try
+			// the next one.
+			if (job->verbose == VERB_HIGH)
+			{
+				logPrintf("%d: Can't move \"%s\": %s\n",
+					depth,cand.c_str(),strerror(errno));
+			}
+			continue;
+		}
+		job->move_candidates.erase(it);
+		job->move_paths.erase(cand);
+
+		if (job->verbose)
+		{
+			logPrintf("%d: Moving \"%s\" to \"%s\": ",
+				depth,cand.c_str(),dest_path.c_str());
+		}
+		if (copyMetaData(
+			(char *)src_path.c_str(),
+			(char *)dest_path.c_str(),src_stat,false) && job->verbose)
+		{
+			logPuts("OK");
+		}
+		++job->files_moved;
+		return true;
+	}
+	return false;
+}
+
+
+
+
+/*** Returns true if the file might still be moved in which case -u should
+     leave it until the end ***/
+bool deferDelete(string &dest_path)
+{
+	if (!job->move_paths.count(dest_path)) return false;
+	job->deferred_deletes.push_back(dest_path);
+	return true;
+}
+
+
+
+
+/*** Delete the files -u would have deleted that weren't used ***/
+void deleteDeferred(void)
+{
+	for(auto &path: job->deferred_deletes)
+	{
+		if (job->stopped) break;
+		if (!job->move_paths.count(path)) continue;
+		if (job->verbose)
+			logPrintf("Deleting unmatched file \"%s\".\n",path.c_str());
+		if (unlink(path.c_str()) == -1)
+		{
+			logPrintf("ERROR: deleteDeferred(): unlink(\"%s\"): %s\n",
+				path.c_str(),strerror(errno));
+			ERROR_EXIT();
+			continue;
+		}
+		++job->unmatched_deleted;
+	}
+	job->deferred_deletes.clear();
+}
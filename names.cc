@@ -11,7 +11,7 @@ map<string,struct stat>::iterator findName(
 {
 	map<string,struct stat>::iterator mit;
 
-	if (!flags.ignore_case) return names_list.find(name);
+	if (!job->flags.ignore_case) return names_list.find(name);
 
 	for(mit=names_list.begin();
 	    mit != names_list.end() && 
@@ -30,24 +30,24 @@ bool nameMatched(const string &name)
 	int i;
 
 	// If no patterns then always match
-	if (!patterns.size()) return true;
+	if (!job->patterns.size()) return true;
 
-	if (regex_type == REGEX_NONE)
+	if (job->regex_type == REGEX_NONE)
 	{
 		// Wildcard matching
-		for(auto pat: patterns)
+		for(auto pat: job->patterns)
 			if (wildMatch(name.c_str(),pat.c_str())) return true;
 		return false;
 	}
 
 	// Regex matching
-	for(regex_t regex: comp_regex)
+	for(regex_t regex: job->comp_regex)
 	{
 		if (regexec(&regex,name.c_str(),REGEX_MAX,pmatch,0) == REG_NOMATCH)
 			continue;
 
 		// If partial then any match will do
-		if (regex_type == REGEX_PARTIAL) return true;
+		if (job->regex_type == REGEX_PARTIAL) return true;
 
 		// Go through all the matches and look for full match
 		for(i=0;pmatch[i].rm_so != -1;++i)
@@ -63,6 +63,81 @@ bool nameMatched(const string &name)
 
 
 
+/*** Add a directory include/exclude rule. Patterns with a '/' in them are
+     matched against the path relative to the source directory, eg "/build"
+     only matches the top level build directory, else just the name. ***/
+void SyncOptions::addDirRule(const string &pattern, bool include)
+{
+	st_dir_rule rule;
+
+	rule.anchored = (pattern.find('/') != string::npos);
+	rule.pattern = pattern;
+	rule.include = include;
+
+	// Anchored patterns always start with '/' to match rel_path
+	if (rule.anchored && pattern[0] != '/') rule.pattern = "/" + pattern;
+
+	// Trailing '/' just means its a directory which they all are
+	if (rule.pattern.size() > 1 && rule.pattern.back() == '/')
+		rule.pattern.pop_back();
+	dir_rules.push_back(rule);
+}
+
+
+
+
+/*** Load directory rules from a file, one per line. Lines starting with '!'
+     are include rules which override earlier excludes, '#' are comments ***/
+bool SyncOptions::loadDirRules(const char *filename)
+{
+	FILE *fp;
+	char line[PATH_MAX+2];
+	char *s;
+	char *e;
+
+	if (!(fp = fopen(filename,"r"))) return false;
+
+	while(fgets(line,sizeof(line),fp))
+	{
+		for(s=line;isspace(*s);++s);
+		for(e=s+strlen(s);e > s && isspace(*(e-1));--e);
+		*e = 0;
+		if (!*s || *s == '#') continue;
+
+		if (*s == '!')
+			addDirRule(s+1,true);
+		else
+			addDirRule(s,false);
+	}
+	fclose(fp);
+	return true;
+}
+
+
+
+
+/*** Returns true if we shouldn't descend into the directory. The last rule
+     that matches wins. ***/
+bool dirExcluded(const string &name, const string &rel_path)
+{
+	bool excluded = false;
+
+	for(auto &rule: job->dir_rules)
+	{
+		if (rule.include != excluded) continue;
+		if (wildMatch(
+			rule.anchored ? rel_path.c_str() : name.c_str(),
+			rule.pattern.c_str()))
+		{
+			excluded = !rule.include;
+		}
+	}
+	return excluded;
+}
+
+
+
+
 /*** Returns true if the string matches the pattern, else false. Supports 
      wildcard patterns containing '*' and '?' ***/
 bool wildMatch(const char *str, const char *pat)
@@ -0,0 +1,394 @@
+/*** Progress reporting (-P and -S). A quick scan first totals up what needs
+     copying then a thread wakes up every so often and reports how far we've
+     got, the current rate, an ETA and what files are being copied. The copy
+     code only updates atomic counters and its in flight slot so it isn't
+     slowed down. Output goes to stderr, a status file or to anyone who
+     connects to a unix socket. ***/
+#include "globals.h"
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define SOCKET_PREFIX "unix:"
+
+static thread_local int my_slot = -1;
+
+void   progressScanDir(string &src_dir, string &dest_dir, bool dest_exists);
+void   progressScanList(void);
+void   progressLoop(st_job *j);
+string progressText(double rate, bool json);
+void   progressStatusFile(string &text);
+bool   progressWrite(int fd, string &text);
+void   progressListen(void);
+
+
+/*** Do the scan and start the reporting thread ***/
+void progressStart(void)
+{
+	job->total_bytes = 0;
+	job->total_items = 0;
+	job->bytes_done = 0;
+
+	if (job->verbose) logPuts("Scanning...");
+	if (job->flags.file_list)
+		progressScanList();
+	else
+		progressScanDir(job->dir_src,job->dir_dest,true);
+	if (job->verbose)
+	{
+		logPrintf("%d items, %s to copy.\n",
+			job->total_items,bytesSizeStr(job->total_bytes));
+	}
+
+	if (!job->status_path.compare(0,strlen(SOCKET_PREFIX),SOCKET_PREFIX))
+		progressListen();
+
+	job->progress_stop = false;
+	job->progress_thread = thread(progressLoop,job);
+}
+
+
+
+
+void progressStop(void)
+{
+	if (!job->progress_thread.joinable()) return;
+	{
+		lock_guard<mutex> lock(job->progress_mutex);
+		job->progress_stop = true;
+	}
+	job->progress_cond.notify_one();
+	job->progress_thread.join();
+
+	if (job->listen_fd != -1)
+	{
+		close(job->listen_fd);
+		unlink(job->status_path.c_str() + strlen(SOCKET_PREFIX));
+	}
+}
+
+
+
+
+/*** Work out roughly what the copy will do using the same quick checks ***/
+void progressScanDir(string &src_dir, string &dest_dir, bool dest_exists)
+{
+	map<string,struct stat> src_files;
+	map<string,struct stat> dest_files;
+	map<string,struct stat>::iterator dest_it;
+	string src_path;
+	string dest_path;
+	bool found;
+
+	if (!loadDir(src_dir,src_files)) return;
+	if (dest_exists) loadDir(dest_dir,dest_files);
+
+	for(auto &[name,src_stat]: src_files)
+	{
+		src_path = src_dir + "/" + name;
+		if (!shardOwns(
+			src_path.substr(job->dir_src.size()),
+			S_ISDIR(src_stat.st_mode))) continue;
+
+		dest_it = (dest_exists ? findName(name,dest_files) : dest_files.end());
+		found = (dest_it != dest_files.end());
+
+		switch(src_stat.st_mode & S_IFMT)
+		{
+		case S_IFREG:
+			if (nameMatched(name) &&
+			    (!found || dest_it->second.st_size != src_stat.st_size))
+			{
+				++job->total_items;
+				job->total_bytes += src_stat.st_size;
+			}
+			break;
+
+		case S_IFDIR:
+			if (job->dir_rules.size() &&
+			    dirExcluded(name,src_path.substr(job->dir_src.size())))
+			{
+				break;
+			}
+			if (found &&
+			    treeCkpDone(src_path.substr(job->dir_src.size()),&src_stat))
+			{
+				break;
+			}
+			if (!found) ++job->total_items;
+			dest_path = dest_dir + "/" + name;
+			progressScanDir(src_path,dest_path,found);
+			break;
+
+		case S_IFLNK:
+			if (nameMatched(name) && !found) ++job->total_items;
+			break;
+		}
+	}
+}
+
+
+
+
+void progressScanList(void)
+{
+	struct stat src_stat;
+	struct stat dest_stat;
+	string path;
+
+	for(auto &rel_path: job->file_list)
+	{
+		if (!shardOwns("/" + rel_path,false)) continue;
+		path = job->dir_src + "/" + rel_path;
+		if (lstat(path.c_str(),&src_stat) == -1) continue;
+		path = job->dir_dest + "/" + rel_path;
+		if (lstat(path.c_str(),&dest_stat) != -1 &&
+		    dest_stat.st_size == src_stat.st_size) continue;
+
+		++job->total_items;
+		if ((src_stat.st_mode & S_IFMT) == S_IFREG)
+			job->total_bytes += src_stat.st_size;
+	}
+}
+
+
+
+
+/*** Called by the copy code when it starts on a file and with "" when it's
+     done. A free slot is claimed for the duration so pool threads can move
+     between jobs. ***/
+void progressFile(const char *path)
+{
+	st_slot *slot;
+	bool claimed;
+	int i;
+
+	if (!job->progress_thread.joinable()) return;
+	if (!path[0])
+	{
+		if (my_slot != -1)
+		{
+			job->slots[my_slot].used.store(false,memory_order_release);
+			job->slots[my_slot].claimed = false;
+		}
+		my_slot = -1;
+		return;
+	}
+	for(i=0;i < PROGRESS_SLOTS;++i)
+	{
+		claimed = false;
+		if (job->slots[i].claimed.compare_exchange_strong(claimed,true))
+			break;
+	}
+	if (i == PROGRESS_SLOTS) return;
+	my_slot = i;
+
+	slot = &job->slots[my_slot];
+	slot->seq.fetch_add(1,memory_order_acq_rel);
+	strncpy(slot->path,path,PATH_MAX-1);
+	slot->path[PATH_MAX-1] = 0;
+	slot->seq.fetch_add(1,memory_order_release);
+
+	// Only now is there something for the progress thread to read
+	slot->used.store(true,memory_order_release);
+}
+
+
+
+
+void progressLoop(st_job *j)
+{
+	struct timespec last;
+	struct timespec now;
+	struct pollfd pfd;
+	unique_lock<mutex> lock(j->progress_mutex);
+	size_t last_bytes = 0;
+	size_t bytes;
+	double rate = 0;
+	double secs;
+	string text;
+	int fd;
+
+	job = j;
+	clock_gettime(CLOCK_MONOTONIC,&last);
+	while(!job->progress_stop)
+	{
+		/* With a socket wait on that so clients get an answer straight
+		   away but not too long so we notice being stopped */
+		if (job->listen_fd != -1)
+		{
+			lock.unlock();
+			pfd.fd = job->listen_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd,1,500) > 0 &&
+			    (fd = accept(job->listen_fd,NULL,NULL)) != -1)
+			{
+				text = progressText(rate,true);
+				progressWrite(fd,text);
+				close(fd);
+			}
+			lock.lock();
+		}
+		else job->progress_cond.wait_for(lock,chrono::seconds(job->progress_secs));
+		if (job->progress_stop) break;
+
+		clock_gettime(CLOCK_MONOTONIC,&now);
+		secs = (now.tv_sec - last.tv_sec) +
+		       (double)(now.tv_nsec - last.tv_nsec) / 1e9;
+		if (secs < job->progress_secs) continue;
+		last = now;
+
+		// Smooth the rate a bit so the ETA doesn't jump around
+		bytes = job->bytes_done.load(memory_order_relaxed);
+		if (rate)
+			rate = rate * 0.7 + ((bytes - last_bytes) / secs) * 0.3;
+		else
+			rate = (bytes - last_bytes) / secs;
+		last_bytes = bytes;
+
+		if (job->listen_fd != -1) continue;
+		if (job->status_path == "")
+		{
+			text = progressText(rate,false);
+			progressWrite(STDERR_FILENO,text);
+		}
+		else
+		{
+			text = progressText(rate,true);
+			progressStatusFile(text);
+		}
+	}
+}
+
+
+
+
+string progressText(double rate, bool json)
+{
+	char line[PATH_MAX+300];
+	char eta[30];
+	string in_flight;
+	string text;
+	size_t bytes = job->bytes_done.load(memory_order_relaxed);
+	size_t left;
+	unsigned seq;
+	int items = job->total_copied + job->files_moved;
+	int i;
+
+	if (rate >= 1 && bytes < job->total_bytes)
+	{
+		left = (size_t)((job->total_bytes - bytes) / rate);
+		snprintf(eta,sizeof(eta),"%lu:%02lu:%02lu",
+			left / 3600,(left / 60) % 60,left % 60);
+	}
+	else strcpy(eta,"-");
+
+	// Get the in flight files without stopping anyone
+	for(i=0;i < PROGRESS_SLOTS;++i)
+	{
+		if (!job->slots[i].used.load(memory_order_acquire)) continue;
+		seq = job->slots[i].seq.load(memory_order_acquire);
+		if (seq & 1) continue;
+		strcpy(line,job->slots[i].path);
+		atomic_thread_fence(memory_order_acquire);
+		if (job->slots[i].seq.load(memory_order_relaxed) != seq) continue;
+
+		if (json)
+		{
+			if (in_flight.size()) in_flight += ",";
+			in_flight += "\"";
+			for(char *s=line;*s;++s)
+			{
+				if (*s == '"' || *s == '\\') in_flight += '\\';
+				in_flight += *s;
+			}
+			in_flight += "\"";
+		}
+		else
+		{
+			if (in_flight.size()) in_flight += ", ";
+			in_flight += line;
+		}
+	}
+
+	if (json)
+	{
+		snprintf(line,sizeof(line),
+			"{\"items_done\":%d,\"items_total\":%d,"
+			"\"bytes_done\":%lu,\"bytes_total\":%lu,"
+			"\"rate\":%.0f,\"eta\":\"%s\",\"in_flight\":[",
+			items,job->total_items,bytes,job->total_bytes,rate,eta);
+		text = line;
+		text += in_flight + "]}\n";
+		return text;
+	}
+
+	snprintf(line,sizeof(line),"Progress: %d/%d items, ",items,job->total_items);
+	text = line;
+	text += bytesSizeStr(bytes);
+	text += "/";
+	text += bytesSizeStr(job->total_bytes);
+	snprintf(line,sizeof(line)," (%d%%), ",
+		job->total_bytes ? (int)(bytes * 100 / job->total_bytes) : 100);
+	text += line;
+	text += bytesSizeStr((size_t)rate);
+	snprintf(line,sizeof(line),"/s, ETA %s",eta);
+	text += line;
+	if (in_flight.size()) text += ", copying: " + in_flight;
+	text += "\n";
+	return text;
+}
+
+
+
+
+/*** Status files are written to a temporary file and renamed so pollers
+     never see a partial one ***/
+void progressStatusFile(string &text)
+{
+	string tmp_path = job->status_path + ".tmp";
+	int fd;
+
+	if ((fd = open(tmp_path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0644)) == -1)
+		return;
+	if (progressWrite(fd,text))
+	{
+		close(fd);
+		rename(tmp_path.c_str(),job->status_path.c_str());
+	}
+	else close(fd);
+}
+
+
+
+
+bool progressWrite(int fd, string &text)
+{
+	return write(fd,text.c_str(),text.size()) == (ssize_t)text.size();
+}
+
+
+
+
+void progressListen(void)
+{
+	struct sockaddr_un addr;
+	const char *path = job->status_path.c_str() + strlen(SOCKET_PREFIX);
+
+	bzero(&addr,sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path,path,sizeof(addr.sun_path)-1);
+	unlink(path);
+
+	if ((job->listen_fd = socket(AF_UNIX,SOCK_STREAM,0)) == -1 ||
+	    bind(job->listen_fd,(struct sockaddr *)&addr,sizeof(addr)) == -1 ||
+	    listen(job->listen_fd,5) == -1)
+	{
+		logPrintf("WARNING: progressListen(): socket(\"%s\"): %s\n",
+			path,strerror(errno));
+		++job->warnings;
+		if (job->listen_fd != -1) close(job->listen_fd);
+		job->listen_fd = -1;
+	}
+}
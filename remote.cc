@@ -0,0 +1,1089 @@
+/*** Remote mode. The sender (-R) scans the source tree and talks to a
+     receiver (-z) at the other end of a pipe, usually via ssh, which does
+     the work in the destination tree. Directory listings are streamed to the
+     receiver without waiting for replies and the receiver replies with the
+     files it needs, along with block hashes of the existing file if -c is
+     given, so only changed data crosses the link. Names and paths from the
+     other end are checked, and symlinks aren't followed, so neither end
+     can be made to go outside its own tree.
+
+     Messages are a 1 byte type, a 4 byte little endian length then the
+     payload. Numbers in the payload are varints, strings are a varint
+     length followed by the bytes. ***/
+#include "globals.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <signal.h>
+
+#define PROTO_VERSION 2
+
+enum
+{
+	MSG_HELLO,
+	MSG_DIR,
+	MSG_DIR_REPLY,
+	MSG_FILE_START,
+	MSG_FILE_DATA,
+	MSG_FILE_END,
+	MSG_FILE_SAME,
+	MSG_END,
+	MSG_STATS,
+
+	// Not sent, used by the sender's reader thread to say EOF
+	MSG_EOF
+};
+
+// Flags passed in the hello message
+enum
+{
+	RFLAG_STOP_ON_ERROR    = 1,
+	RFLAG_DELETE_UNMATCHED = 2,
+	RFLAG_COPY_METADATA    = 4,
+	RFLAG_COMPARE_CONTENTS = 8,
+	RFLAG_IGNORE_CASE      = 16,
+	RFLAG_COPY_DOT_FILES   = 32
+};
+
+// Entry in a directory listing
+struct st_rentry
+{
+	string name;
+	struct stat st;
+	bool matched;
+	string target;
+};
+
+struct st_msg
+{
+	int type;
+	string data;
+	size_t pos;
+	bool ok;
+
+	st_msg() { type = MSG_EOF; pos = 0; ok = true; }
+};
+
+static int send_fd;
+static int recv_fd;
+static mutex send_mutex;
+
+// Sender side replies queue
+static mutex reply_mutex;
+static condition_variable reply_cond;
+static deque<st_msg> reply_queue;
+static int dirs_sent;
+static bool scan_done;
+
+void     putNum(string &buf, uint64_t num);
+void     putStr(string &buf, const string &str);
+void     putStat(string &buf, struct stat *st);
+uint64_t getNum(st_msg &msg);
+string   getStr(st_msg &msg);
+void     getStat(st_msg &msg, struct stat *st);
+void     sendMsg(int type, string &payload);
+bool     recvMsg(int fd, st_msg &msg);
+bool     readAll(int fd, char *buff, size_t len);
+pid_t    startReceiver(const char *cmd);
+void     sendDir(string &rel_path, struct stat *dir_stat, int depth);
+void     senderReader(st_job *j);
+void     senderData(st_job *j);
+void     sendFile(string &rel_dir, st_msg &reply);
+void     sendFileStart(string &rel_path, bool patch, struct stat *st);
+void     sendFileSame(string &rel_path, struct stat *st);
+void     recvDir(st_msg &msg);
+void     recvFileStart(st_msg &msg, int &fd, string &path, struct stat *st);
+void     recvFileData(st_msg &msg, int fd, string &path);
+void     recvFileEnd(st_msg &msg, int &fd, string &path, struct stat *st);
+void     recvFileSame(st_msg &msg);
+bool     safeName(const string &name);
+bool     safePath(const string &rel_path);
+bool     realParents(const string &root, const string &rel_path);
+void     addStats(st_msg &msg);
+
+
+/********************************* SENDER ***********************************/
+
+/*** Run the sync with the destination at the other end of cmd ***/
+void remoteSend(const char *cmd)
+{
+	struct stat fs;
+	string payload;
+	string root;
+	thread reader;
+	thread data;
+	st_msg msg;
+	pid_t pid;
+	int status;
+
+	if (lstat(job->dir_src.c_str(),&fs) == -1)
+	{
+		logPrintf("ERROR: remoteSend(): lstat(\"%s\"): %s\n",
+			job->dir_src.c_str(),strerror(errno));
+		exit(1);
+	}
+	// Want an error from write() if the receiver dies, not a signal
+	signal(SIGPIPE,SIG_IGN);
+	pid = startReceiver(cmd);
+
+	putNum(payload,PROTO_VERSION);
+	putNum(payload,
+		(job->flags.stop_on_error ? RFLAG_STOP_ON_ERROR : 0) |
+		(job->flags.delete_unmatched ? RFLAG_DELETE_UNMATCHED : 0) |
+		(job->flags.copy_metadata ? RFLAG_COPY_METADATA : 0) |
+		(job->flags.compare_contents ? RFLAG_COMPARE_CONTENTS : 0) |
+		(job->flags.ignore_case ? RFLAG_IGNORE_CASE : 0) |
+		(job->flags.copy_dot_files ? RFLAG_COPY_DOT_FILES : 0));
+	putNum(payload,job->verbose);
+	sendMsg(MSG_HELLO,payload);
+
+	if (!recvMsg(recv_fd,msg) || msg.type != MSG_HELLO)
+	{
+		logPuts("ERROR: remoteSend(): No hello from the receiver.");
+		exit(1);
+	}
+
+	dirs_sent = 0;
+	scan_done = false;
+	reader = thread(senderReader,job);
+	data = thread(senderData,job);
+
+	sendDir(root,&fs,1);
+	{
+		lock_guard<mutex> lock(reply_mutex);
+		scan_done = true;
+	}
+	reply_cond.notify_one();
+
+	data.join();
+	reader.join();
+	close(send_fd);
+	close(recv_fd);
+	if (waitpid(pid,&status,0) != -1 &&
+	    (!WIFEXITED(status) || WEXITSTATUS(status)))
+	{
+		logPuts("WARNING: The receiver exited with an error.");
+		++job->warnings;
+	}
+	finishSync();
+}
+
+
+
+
+/*** Run the command with its stdin and stdout connected to us ***/
+pid_t startReceiver(const char *cmd)
+{
+	int to_child[2];
+	int from_child[2];
+	pid_t pid;
+
+	if (pipe(to_child) == -1 || pipe(from_child) == -1)
+	{
+		logPrintf("ERROR: startReceiver(): pipe(): %s\n",strerror(errno));
+		exit(1);
+	}
+	switch((pid = fork()))
+	{
+	case -1:
+		logPrintf("ERROR: startReceiver(): fork(): %s\n",strerror(errno));
+		exit(1);
+	case 0:
+		dup2(to_child[0],STDIN_FILENO);
+		dup2(from_child[1],STDOUT_FILENO);
+		close(to_child[0]);
+		close(to_child[1]);
+		close(from_child[0]);
+		close(from_child[1]);
+		execl("/bin/sh","sh","-c",cmd,(char *)NULL);
+		_exit(127);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+	send_fd = to_child[1];
+	recv_fd = from_child[0];
+	return pid;
+}
+
+
+
+
+/*** Send the listing of a directory then recurse into its subdirectories.
+     Files that don't match any -p pattern are still listed so that -u
+     doesn't delete them at the other end. ***/
+void sendDir(string &rel_path, struct stat *dir_stat, int depth)
+{
+	map<string,struct stat> src_files;
+	string src_dir = job->dir_src + rel_path;
+	string payload;
+	string sub_path;
+	char target[PATH_MAX+1];
+	mode_t type;
+	ssize_t len;
+
+	// If we can't read it don't send an empty listing or -u would empty
+	// the directory at the other end
+	if (!loadDir(src_dir,src_files)) return;
+
+	putStr(payload,rel_path);
+	putNum(payload,depth);
+	putStat(payload,dir_stat);
+	putNum(payload,src_files.size());
+	for(auto &[name,st]: src_files)
+	{
+		type = st.st_mode & S_IFMT;
+		putStr(payload,name);
+		putNum(payload,(type != S_IFDIR && nameMatched(name)));
+		putStat(payload,&st);
+		if (type == S_IFLNK)
+		{
+			sub_path = src_dir + "/" + name;
+			if ((len = readlink(sub_path.c_str(),target,PATH_MAX)) == -1)
+			{
+				logPrintf("ERROR: sendDir(): readlink(\"%s\"): %s\n",
+					sub_path.c_str(),strerror(errno));
+				ERROR_EXIT();
+				len = 0;
+			}
+			putStr(payload,string(target,len));
+		}
+	}
+	sendMsg(MSG_DIR,payload);
+	{
+		lock_guard<mutex> lock(reply_mutex);
+		++dirs_sent;
+	}
+
+	for(auto &[name,st]: src_files)
+	{
+		if ((st.st_mode & S_IFMT) != S_IFDIR) continue;
+		sub_path = rel_path + "/" + name;
+		if (job->dir_rules.size() && dirExcluded(name,sub_path))
+		{
+			if (job->verbose == VERB_HIGH)
+			{
+				logPrintf("%d: Not descending into excluded directory \"%s%s\".\n",
+					depth,job->dir_src.c_str(),sub_path.c_str());
+			}
+			continue;
+		}
+		sendDir(sub_path,&st,depth+1);
+	}
+}
+
+
+
+
+/*** Reads everything the receiver sends us so it never blocks writing
+     while we're blocked writing to it ***/
+void senderReader(st_job *j)
+{
+	st_msg msg;
+	int type;
+
+	job = j;
+	do
+	{
+		msg = st_msg();
+		if (!recvMsg(recv_fd,msg)) msg.type = MSG_EOF;
+		type = msg.type;
+		{
+			lock_guard<mutex> lock(reply_mutex);
+			reply_queue.push_back(move(msg));
+		}
+		reply_cond.notify_one();
+	} while(type != MSG_EOF && type != MSG_STATS);
+}
+
+
+
+
+/*** Sends the files the receiver asked for. When all directories have been
+     replied to tell the receiver we're done and wait for its stats. ***/
+void senderData(st_job *j)
+{
+	string payload;
+	string rel_dir;
+	st_msg msg;
+	int replies = 0;
+	bool ended = false;
+
+	job = j;
+	while(true)
+	{
+		{
+			unique_lock<mutex> lock(reply_mutex);
+			reply_cond.wait(lock,[&] {
+				return reply_queue.size() ||
+				       (!ended && scan_done && replies == dirs_sent);
+			});
+			if (!reply_queue.size())
+			{
+				lock.unlock();
+				sendMsg(MSG_END,payload);
+				ended = true;
+				continue;
+			}
+			msg = move(reply_queue.front());
+			reply_queue.pop_front();
+		}
+
+		switch(msg.type)
+		{
+		case MSG_DIR_REPLY:
+			rel_dir = getStr(msg);
+			if (rel_dir.size() && !safePath(rel_dir)) msg.ok = false;
+			while(msg.ok && msg.pos < msg.data.size())
+				sendFile(rel_dir,msg);
+			if (!msg.ok)
+			{
+				logPuts("ERROR: senderData(): Bad reply from receiver.");
+				exit(1);
+			}
+			{
+				lock_guard<mutex> lock(reply_mutex);
+				++replies;
+			}
+			break;
+
+		case MSG_STATS:
+			addStats(msg);
+			return;
+
+		case MSG_EOF:
+			logPuts("ERROR: senderData(): Lost connection to the receiver.");
+			exit(1);
+
+		default:
+			logPrintf("ERROR: senderData(): Unexpected message type %d.\n",
+				msg.type);
+			exit(1);
+		}
+	}
+}
+
+
+
+
+/*** Send one file the receiver asked for. If it gave us block hashes of its
+     copy to patch then only blocks that differ are sent and if none do
+     nothing is sent at all. ***/
+void sendFile(string &rel_dir, st_msg &reply)
+{
+	vector<uint64_t> hashes;
+	struct stat st;
+	string name = getStr(reply);
+	string rel_path = rel_dir + "/" + name;
+	string src_path = job->dir_src + rel_path;
+	string payload;
+	char *buff = bulkBuffer(0);
+	uint64_t cnt;
+	uint64_t i;
+	off_t offset;
+	ssize_t len;
+	bool started = false;
+	bool patch;
+	int fd = -1;
+
+	patch = getNum(reply);
+	for(i=0,cnt=getNum(reply);i < cnt && reply.ok;++i)
+		hashes.push_back(getNum(reply));
+
+	// Don't let the receiver have us read anything outside the source
+	if (!safeName(name)) reply.ok = false;
+	if (!reply.ok) return;
+
+	if (!realParents(job->dir_src,rel_path) ||
+	    (fd = bulkOpen(src_path.c_str(),O_RDONLY | O_NOFOLLOW,0)) == -1 ||
+	    fstat(fd,&st) == -1)
+	{
+		logPrintf("ERROR: sendFile(): open(\"%s\"): %s\n",
+			src_path.c_str(),strerror(errno));
+		if (fd != -1) close(fd);
+		ERROR_EXIT();
+		return;
+	}
+	bulkStart(fd,-1,0);
+
+	for(i=0,offset=0;(len = bulkRead(fd,buff,HASH_BLOCK)) > 0;++i,offset += len)
+	{
+		bulkAdvance(fd,-1,offset,len);
+		if (i < hashes.size() && hashBlock(buff,len,0) == hashes[i])
+			continue;
+		if (!started)
+		{
+			sendFileStart(rel_path,patch,&st);
+			started = true;
+		}
+		payload.clear();
+		putNum(payload,offset);
+		payload.append(buff,len);
+		sendMsg(MSG_FILE_DATA,payload);
+	}
+	close(fd);
+
+	if (len == -1)
+	{
+		logPrintf("ERROR: sendFile(): read(\"%s\"): %s\n",
+			src_path.c_str(),strerror(errno));
+		ERROR_EXIT();
+	}
+
+	// Empty files still need creating and if the number of blocks has
+	// changed since the receiver looked it needs truncating. If nothing
+	// has changed the metadata still might have.
+	if (!started && (!patch || i != hashes.size()))
+	{
+		sendFileStart(rel_path,patch,&st);
+		started = true;
+	}
+	else if (!started)
+	{
+		sendFileSame(rel_path,&st);
+		return;
+	}
+	if (started)
+	{
+		payload.clear();
+		putNum(payload,offset);
+		sendMsg(MSG_FILE_END,payload);
+	}
+}
+
+
+
+
+void sendFileStart(string &rel_path, bool patch, struct stat *st)
+{
+	string payload;
+
+	putStr(payload,rel_path);
+	putNum(payload,patch);
+	putStat(payload,st);
+	sendMsg(MSG_FILE_START,payload);
+}
+
+
+
+
+void sendFileSame(string &rel_path, struct stat *st)
+{
+	string payload;
+
+	putStr(payload,rel_path);
+	putStat(payload,st);
+	sendMsg(MSG_FILE_SAME,payload);
+}
+
+
+
+
+/*** The receiver's totals are what actually got done ***/
+void addStats(st_msg &msg)
+{
+	job->files_copied += getNum(msg);
+	job->bytes_copied += getNum(msg);
+	job->symlinks_copied += getNum(msg);
+	job->dirs_copied += getNum(msg);
+	job->total_copied += getNum(msg);
+	job->unmatched_deleted += getNum(msg);
+	job->meta_updated += getNum(msg);
+	job->warnings += getNum(msg);
+	job->errors += getNum(msg);
+}
+
+
+/******************************** RECEIVER **********************************/
+
+/*** Do what the sender tells us with stdin and stdout as the link. Logging
+     goes to stderr. ***/
+void remoteReceive(void)
+{
+	struct stat file_stat;
+	string payload;
+	string file_path;
+	st_msg msg;
+	int fd = -1;
+	int rflags;
+
+	send_fd = STDOUT_FILENO;
+	recv_fd = STDIN_FILENO;
+
+	if (!recvMsg(recv_fd,msg) || msg.type != MSG_HELLO ||
+	    getNum(msg) != PROTO_VERSION)
+	{
+		logPuts("ERROR: remoteReceive(): Bad hello from the sender.");
+		exit(1);
+	}
+	rflags = getNum(msg);
+	job->flags.stop_on_error = !!(rflags & RFLAG_STOP_ON_ERROR);
+	job->flags.delete_unmatched = !!(rflags & RFLAG_DELETE_UNMATCHED);
+	job->flags.copy_metadata = !!(rflags & RFLAG_COPY_METADATA);
+	job->flags.compare_contents = !!(rflags & RFLAG_COMPARE_CONTENTS);
+	job->flags.ignore_case = !!(rflags & RFLAG_IGNORE_CASE);
+	job->flags.copy_dot_files = !!(rflags & RFLAG_COPY_DOT_FILES);
+	job->flags.copy_xattrs = 0;
+	job->verbose = getNum(msg);
+	sendMsg(MSG_HELLO,payload);
+
+	while(recvMsg(recv_fd,msg))
+	{
+		switch(msg.type)
+		{
+		case MSG_DIR:
+			recvDir(msg);
+			break;
+		case MSG_FILE_START:
+			recvFileStart(msg,fd,file_path,&file_stat);
+			break;
+		case MSG_FILE_DATA:
+			recvFileData(msg,fd,file_path);
+			break;
+		case MSG_FILE_END:
+			recvFileEnd(msg,fd,file_path,&file_stat);
+			break;
+		case MSG_FILE_SAME:
+			recvFileSame(msg);
+			break;
+		case MSG_END:
+			sync();
+			payload.clear();
+			putNum(payload,job->files_copied);
+			putNum(payload,job->bytes_copied);
+			putNum(payload,job->symlinks_copied);
+			putNum(payload,job->dirs_copied);
+			putNum(payload,job->total_copied);
+			putNum(payload,job->unmatched_deleted);
+			putNum(payload,job->meta_updated);
+			putNum(payload,job->warnings);
+			putNum(payload,job->errors);
+			sendMsg(MSG_STATS,payload);
+			return;
+		default:
+			logPrintf("ERROR: remoteReceive(): Unexpected message type %d.\n",
+				msg.type);
+			exit(1);
+		}
+		if (!msg.ok)
+		{
+			logPuts("ERROR: remoteReceive(): Bad message from sender.");
+			exit(1);
+		}
+		msg = st_msg();
+	}
+	logPuts("ERROR: remoteReceive(): Lost connection to the sender.");
+	exit(1);
+}
+
+
+
+
+/*** Make the directory, delete unmatched files, create symlinks and reply
+     with the files we need. Always reply, even if empty, as the sender
+     counts them. ***/
+void recvDir(st_msg &msg)
+{
+	map<string,struct stat> src_files;
+	map<string,struct stat> dest_files;
+	map<string,struct stat>::iterator dest_it;
+	vector<st_rentry> entries;
+	vector<uint64_t> hashes;
+	struct stat dir_stat;
+	struct stat *dest_stat;
+	st_rentry ent;
+	string rel_path = getStr(msg);
+	string dest_dir = job->dir_dest + rel_path;
+	string dest_path;
+	string payload;
+	uint64_t hash;
+	uint64_t cnt;
+	int depth;
+
+	depth = getNum(msg);
+	getStat(msg,&dir_stat);
+	putStr(payload,rel_path);
+
+	for(cnt=getNum(msg);cnt && msg.ok;--cnt)
+	{
+		ent.name = getStr(msg);
+		ent.matched = getNum(msg);
+		getStat(msg,&ent.st);
+		ent.target.clear();
+		if ((ent.st.st_mode & S_IFMT) == S_IFLNK) ent.target = getStr(msg);
+		if (!safeName(ent.name)) msg.ok = false;
+		src_files[ent.name] = ent.st;
+		entries.push_back(ent);
+	}
+	// Anything that could reach outside the destination is a bad message
+	if (!msg.ok || (rel_path.size() && !safePath(rel_path)))
+	{
+		msg.ok = false;
+		return;
+	}
+
+	if (rel_path.size())
+	{
+		if (!realParents(job->dir_dest,rel_path))
+		{
+			logPrintf("ERROR: recvDir(): \"%s\": %s\n",
+				dest_dir.c_str(),strerror(errno));
+			ERROR_EXIT();
+			sendMsg(MSG_DIR_REPLY,payload);
+			return;
+		}
+		if (!makeDir(NULL,(char *)dest_dir.c_str(),&dir_stat,depth-1))
+		{
+			sendMsg(MSG_DIR_REPLY,payload);
+			return;
+		}
+		if (errno != EEXIST)
+		{
+			++job->dirs_copied;
+			++job->total_copied;
+		}
+	}
+	else if (lstat(dest_dir.c_str(),&dir_stat) == -1)
+	{
+		logPrintf("ERROR: recvDir(): lstat(\"%s\"): %s\n",
+			dest_dir.c_str(),strerror(errno));
+		exit(1);
+	}
+	loadDir(dest_dir,dest_files);
+
+	if (job->flags.delete_unmatched)
+	{
+		for(auto &[name,tmp_stat]: dest_files)
+		{
+			if (findName(name,src_files) == src_files.end())
+			{
+				dest_path = dest_dir + "/" + name;
+				deleteUnmatched(name,dest_path,&tmp_stat,depth);
+			}
+		}
+	}
+
+	for(auto &e: entries)
+	{
+		if (!e.matched) continue;
+
+		dest_path = dest_dir + "/" + e.name;
+		if ((dest_it = findName(e.name,dest_files)) != dest_files.end())
+			dest_stat = &dest_it->second;
+		else
+			dest_stat = NULL;
+
+		switch(e.st.st_mode & S_IFMT)
+		{
+		case S_IFREG:
+			hashes.clear();
+			if (dest_stat &&
+			    (dest_stat->st_size != e.st.st_size ||
+			     (!job->flags.compare_contents &&
+			      job->flags.copy_metadata &&
+			      !sameMTime(&e.st,dest_stat))))
+			{
+				// Different size or changed in place
+				dest_stat = NULL;
+			}
+			else if (dest_stat)
+			{
+				if (!job->flags.compare_contents)
+				{
+					if (job->verbose == VERB_HIGH)
+					{
+						logPrintf("%d: Not copying \"%s\" as it is the same size.\n",
+							depth,dest_path.c_str());
+					}
+					updateMetaData(
+						NULL,
+						(char *)dest_path.c_str(),&e.st,dest_stat,depth);
+					continue;
+				}
+				// Let the sender work out which blocks differ
+				if (!hashFile(dest_path.c_str(),hash,&hashes))
+				{
+					logPrintf("ERROR: recvDir(): hashFile(\"%s\"): %s\n",
+						dest_path.c_str(),strerror(errno));
+					ERROR_EXIT();
+					continue;
+				}
+			}
+			putStr(payload,e.name);
+			putNum(payload,dest_stat != NULL && job->flags.compare_contents);
+			putNum(payload,hashes.size());
+			for(uint64_t h: hashes) putNum(payload,h);
+			break;
+
+		case S_IFLNK:
+			if (dest_stat && (dest_stat->st_mode & S_IFMT) != S_IFLNK)
+			{
+				logPrintf("ERROR: Destination \"%s\" exists and it is not a symlink.\n",
+					dest_path.c_str());
+				ERROR_EXIT();
+				continue;
+			}
+			setSymbolicLink(
+				NULL,
+				(char *)e.target.c_str(),
+				(char *)dest_path.c_str(),&e.st,dest_stat,depth);
+			break;
+		}
+	}
+	sendMsg(MSG_DIR_REPLY,payload);
+}
+
+
+
+
+void recvFileStart(st_msg &msg, int &fd, string &path, struct stat *st)
+{
+	bool patch;
+
+	path = getStr(msg);
+	patch = getNum(msg);
+	getStat(msg,st);
+	if (!msg.ok || !safePath(path))
+	{
+		msg.ok = false;
+		return;
+	}
+	path = job->dir_dest + path;
+
+	if (job->verbose)
+	{
+		logCopyStart(string(patch ? "Updating" : "Receiving") +
+			" file \"" + path + "\"");
+	}
+	if (!realParents(job->dir_dest,path.substr(job->dir_dest.size())))
+		fd = -1;
+	else if (patch)
+		fd = bulkOpen(path.c_str(),O_WRONLY | O_NOFOLLOW,0);
+	else
+	{
+		fd = bulkOpen(
+			path.c_str(),
+			O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW,st->st_mode);
+	}
+	if (fd == -1)
+	{
+		logPrintf("ERROR: recvFileStart(): open(\"%s\"): %s\n",
+			path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return;
+	}
+	bulkStart(fd,-1,0);
+}
+
+
+
+
+void recvFileData(st_msg &msg, int fd, string &path)
+{
+	off_t offset = getNum(msg);
+	size_t len = msg.data.size() - msg.pos;
+
+	// Open failed and we're not stopping on errors so just ignore it
+	if (fd == -1 || !msg.ok) return;
+
+	if (pwrite(fd,msg.data.data() + msg.pos,len,offset) != (ssize_t)len)
+	{
+		logPrintf("ERROR: recvFileData(): pwrite(\"%s\"): %s\n",
+			path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return;
+	}
+	job->bytes_copied += len;
+}
+
+
+
+
+void recvFileEnd(st_msg &msg, int &fd, string &path, struct stat *st)
+{
+	off_t size = getNum(msg);
+
+	if (fd == -1) return;
+	if (ftruncate(fd,size) == -1)
+	{
+		logPrintf("ERROR: recvFileEnd(): ftruncate(\"%s\"): %s\n",
+			path.c_str(),strerror(errno));
+		ERROR_EXIT();
+	}
+	close(fd);
+	fd = -1;
+
+	++job->files_copied;
+	++job->total_copied;
+	if (copyMetaData(NULL,(char *)path.c_str(),st,false) && job->verbose)
+		logCopyDone(path,size);
+}
+
+
+/*** The sender found the contents the same so only the metadata might need
+     updating ***/
+void recvFileSame(st_msg &msg)
+{
+	struct stat src_stat;
+	struct stat dest_stat;
+	string rel_path = getStr(msg);
+	string path;
+
+	getStat(msg,&src_stat);
+	if (!msg.ok || !safePath(rel_path))
+	{
+		msg.ok = false;
+		return;
+	}
+	path = job->dir_dest + rel_path;
+	if (!realParents(job->dir_dest,rel_path) ||
+	    lstat(path.c_str(),&dest_stat) == -1)
+	{
+		logPrintf("ERROR: recvFileSame(): lstat(\"%s\"): %s\n",
+			path.c_str(),strerror(errno));
+		ERROR_EXIT();
+		return;
+	}
+	if (!S_ISREG(dest_stat.st_mode))
+	{
+		logPrintf("ERROR: Destination \"%s\" is no longer a regular file.\n",
+			path.c_str());
+		ERROR_EXIT();
+		return;
+	}
+	updateMetaData(
+		NULL,
+		(char *)path.c_str(),&src_stat,&dest_stat,
+		(int)count(rel_path.begin(),rel_path.end(),'/'));
+}
+
+
+
+
+/*** A name from the other end must be a single path component ***/
+bool safeName(const string &name)
+{
+	return name.size() &&
+	       name != "." &&
+	       name != ".." && name.find_first_of(string("/\0",2)) == string::npos;
+}
+
+
+
+
+/*** A relative path from the other end must be "/" separated names ***/
+bool safePath(const string &rel_path)
+{
+	size_t pos;
+	size_t start;
+
+	if (rel_path[0] != '/') return false;
+	for(start=1;;start=pos+1)
+	{
+		pos = rel_path.find('/',start);
+		if (!safeName(rel_path.substr(start,pos - start))) return false;
+		if (pos == string::npos) return true;
+	}
+}
+
+
+
+
+/*** A checked path can still go through a symlink made earlier in the
+     tree so every directory leading to it must be a real one. Sets errno
+     if not. ***/
+bool realParents(const string &root, const string &rel_path)
+{
+	struct stat fs;
+	size_t pos;
+
+	for(pos=rel_path.find('/',1);pos != string::npos;pos=rel_path.find('/',pos+1))
+	{
+		if (lstat((root + rel_path.substr(0,pos)).c_str(),&fs) == -1)
+			return errno == ENOENT;
+		if (!S_ISDIR(fs.st_mode))
+		{
+			errno = ENOTDIR;
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/******************************** PROTOCOL **********************************/
+
+void putNum(string &buf, uint64_t num)
+{
+	for(;num >= 0x80;num >>= 7) buf += (char)((num & 0x7F) | 0x80);
+	buf += (char)num;
+}
+
+
+
+
+void putStr(string &buf, const string &str)
+{
+	putNum(buf,str.size());
+	buf += str;
+}
+
+
+
+
+void putStat(string &buf, struct stat *st)
+{
+	putNum(buf,st->st_mode);
+	putNum(buf,st->st_uid);
+	putNum(buf,st->st_gid);
+	putNum(buf,st->st_size);
+	putNum(buf,st->st_atime);
+	putNum(buf,st->st_mtime);
+}
+
+
+
+
+/*** Sets msg.ok to false if we run off the end ***/
+uint64_t getNum(st_msg &msg)
+{
+	uint64_t num = 0;
+	int shift;
+	unsigned char c;
+
+	for(shift=0;shift < 64;shift += 7)
+	{
+		if (msg.pos >= msg.data.size())
+		{
+			msg.ok = false;
+			return 0;
+		}
+		c = msg.data[msg.pos++];
+		num |= (uint64_t)(c & 0x7F) << shift;
+		if (!(c & 0x80)) return num;
+	}
+	msg.ok = false;
+	return 0;
+}
+
+
+
+
+string getStr(st_msg &msg)
+{
+	size_t len = getNum(msg);
+	size_t pos = msg.pos;
+
+	if (!msg.ok || len > msg.data.size() - pos)
+	{
+		msg.ok = false;
+		return "";
+	}
+	msg.pos += len;
+	return msg.data.substr(pos,len);
+}
+
+
+
+
+void getStat(st_msg &msg, struct stat *st)
+{
+	bzero(st,sizeof(struct stat));
+	st->st_mode = getNum(msg);
+	st->st_uid = getNum(msg);
+	st->st_gid = getNum(msg);
+	st->st_size = getNum(msg);
+#ifdef __APPLE__
+	st->st_atimespec.tv_sec = getNum(msg);
+	st->st_mtimespec.tv_sec = getNum(msg);
+#else
+	st->st_atim.tv_sec = getNum(msg);
+	st->st_mtim.tv_sec = getNum(msg);
+#endif
+}
+
+
+
+
+/*** Messages can come from more than one thread so lock around the whole
+     message. If the other end has gone there's nothing we can do. ***/
+void sendMsg(int type, string &payload)
+{
+	unsigned char hdr[5];
+	struct iovec iov[2];
+	size_t len = payload.size();
+	ssize_t wrote;
+	int i;
+
+	hdr[0] = type;
+	for(i=0;i < 4;++i) hdr[i+1] = (len >> (i * 8)) & 0xFF;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)payload.data();
+	iov[1].iov_len = len;
+
+	lock_guard<mutex> lock(send_mutex);
+	for(i=0;i < 2;)
+	{
+		if ((wrote = writev(send_fd,iov+i,2-i)) == -1)
+		{
+			if (errno == EINTR) continue;
+			logPrintf("ERROR: sendMsg(): write(): %s\n",strerror(errno));
+			exit(1);
+		}
+		for(;i < 2 && (size_t)wrote >= iov[i].iov_len;++i)
+			wrote -= iov[i].iov_len;
+		if (i < 2)
+		{
+			iov[i].iov_base = (char *)iov[i].iov_base + wrote;
+			iov[i].iov_len -= wrote;
+		}
+	}
+}
+
+
+
+
+/*** Returns false on EOF or error ***/
+bool recvMsg(int fd, st_msg &msg)
+{
+	unsigned char hdr[5];
+	size_t len;
+	int i;
+
+	if (!readAll(fd,(char *)hdr,sizeof(hdr))) return false;
+
+	msg.type = hdr[0];
+	for(i=0,len=0;i < 4;++i) len |= (size_t)hdr[i+1] << (i * 8);
+	msg.data.resize(len);
+	msg.pos = 0;
+	msg.ok = true;
+	return readAll(fd,msg.data.data(),len);
+}
+
+
+
+
+bool readAll(int fd, char *buff, size_t len)
+{
+	ssize_t res;
+
+	for(;len;buff += res,len -= res)
+	{
+		if ((res = read(fd,buff,len)) == -1)
+		{
+			if (errno == EINTR)
+			{
+				res = 0;
+				continue;
+			}
+			return false;
+		}
+		if (!res) return false;
+	}
+	return true;
+}
@@ -0,0 +1,142 @@
+/*** Sharding (-H) and stats files (-W, -G). With -H i/N each of N runs,
+     which can be on different machines sharing the same mounts, only does
+     the files whose relative path hashes to its shard, or with -T whole
+     top level subtrees. Every run still walks and creates the directories
+     it needs so the shards can go in any order. Each run can write its
+     counts to a stats file and -G adds them up afterwards. ***/
+#include "globals.h"
+
+struct st_stats_field
+{
+	const char *name;
+	atomic<size_t> SyncStats::*big;
+	atomic<int> SyncStats::*num;
+};
+
+static st_stats_field stats_fields[] =
+{
+	{ "bytes_copied",      &SyncStats::bytes_copied,  NULL },
+	{ "bytes_deduped",     &SyncStats::bytes_deduped, NULL },
+	{ "files_copied",      NULL, &SyncStats::files_copied },
+	{ "files_moved",       NULL, &SyncStats::files_moved },
+	{ "files_cloned",      NULL, &SyncStats::files_cloned },
+	{ "files_deduped",     NULL, &SyncStats::files_deduped },
+	{ "meta_updated",      NULL, &SyncStats::meta_updated },
+	{ "files_linked",      NULL, &SyncStats::files_linked },
+	{ "files_appended",    NULL, &SyncStats::files_appended },
+	{ "symlinks_copied",   NULL, &SyncStats::symlinks_copied },
+	{ "dirs_copied",       NULL, &SyncStats::dirs_copied },
+	{ "total_copied",      NULL, &SyncStats::total_copied },
+	{ "xattr_copied",      NULL, &SyncStats::xattr_copied },
+	{ "xattr_files",       NULL, &SyncStats::xattr_files },
+	{ "unmatched_deleted", NULL, &SyncStats::unmatched_deleted },
+	{ "warnings",          NULL, &SyncStats::warnings },
+	{ "errors",            NULL, &SyncStats::errors }
+};
+
+#define NUM_STATS_FIELDS (int)(sizeof(stats_fields) / sizeof(st_stats_field))
+
+
+/*** Returns true if this run should do the path, which is relative to the
+     source dir and starts with a '/'. Unless sharding by subtree all
+     directories are done so the files in them can be. ***/
+bool shardOwns(const string &rel_path, bool dir)
+{
+	size_t len;
+
+	if (!job->shard_count) return true;
+	if (job->flags.shard_subtree)
+		len = rel_path.find('/',1);
+	else if (dir)
+		return true;
+	else
+		len = rel_path.size();
+	if (len == string::npos) len = rel_path.size();
+
+	return hashBlock(rel_path.data(),len,0) % job->shard_count ==
+	       (uint64_t)job->shard_index;
+}
+
+
+
+
+/*** Write the counts as "name value" lines via a temporary file so a merge
+     never reads a partial one ***/
+void statsWrite(void)
+{
+	FILE *fp;
+	string tmp_path = job->stats_file + ".tmp";
+	int i;
+
+	if (!(fp = fopen(tmp_path.c_str(),"w")))
+	{
+		logPrintf("WARNING: statsWrite(): fopen(\"%s\"): %s\n",
+			tmp_path.c_str(),strerror(errno));
+		++job->warnings;
+		return;
+	}
+	for(i=0;i < NUM_STATS_FIELDS;++i)
+	{
+		st_stats_field &f = stats_fields[i];
+		if (f.big)
+			fprintf(fp,"%s %lu\n",f.name,(unsigned long)(job->*f.big).load());
+		else
+			fprintf(fp,"%s %d\n",f.name,(job->*f.num).load());
+	}
+	fprintf(fp,"exit_code %d\n",job->exit_code);
+
+	if (fclose(fp) == EOF || rename(tmp_path.c_str(),job->stats_file.c_str()) == -1)
+	{
+		logPrintf("WARNING: statsWrite(): \"%s\": %s\n",
+			job->stats_file.c_str(),strerror(errno));
+		++job->warnings;
+		unlink(tmp_path.c_str());
+	}
+}
+
+
+
+
+/*** Add up the stats files and print the totals. Returns the first non
+     zero exit code any of the runs had. ***/
+int statsMerge(vector<string> &paths)
+{
+	SyncStats total;
+	FILE *fp;
+	char name[100];
+	unsigned long val;
+	int exit_code = 0;
+	int i;
+
+	for(auto &path: paths)
+	{
+		if (!(fp = fopen(path.c_str(),"r")))
+		{
+			logPrintf("ERROR: statsMerge(): fopen(\"%s\"): %s\n",
+				path.c_str(),strerror(errno));
+			return errno;
+		}
+		while(fscanf(fp,"%99s %lu",name,&val) == 2)
+		{
+			if (!strcmp(name,"exit_code"))
+			{
+				if (!exit_code) exit_code = (int)val;
+				continue;
+			}
+			for(i=0;i < NUM_STATS_FIELDS;++i)
+			{
+				st_stats_field &f = stats_fields[i];
+				if (strcmp(name,f.name)) continue;
+				if (f.big)
+					total.*f.big += val;
+				else
+					total.*f.num += (int)val;
+				break;
+			}
+		}
+		fclose(fp);
+	}
+	logPrintf("Merged %lu stats files.\n",paths.size());
+	printStats(total);
+	return exit_code;
+}
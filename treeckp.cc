@@ -0,0 +1,251 @@
+/*** Tree walk checkpoints (-C). As each directory and everything under it
+     is finished without errors a line is appended to the checkpoint file
+     with the directory's path relative to the source and a stamp of its
+     inode, mtime and ctime. The file is flushed to disk every so often. If
+     the run doesn't finish the file is left behind and the next run skips
+     any directory listed in it whose stamp hasn't changed, so it carries on
+     more or less where the last one stopped. Adding or removing a file
+     only changes the stamp of the directory it's in so every directory
+     under a skipped one is checked too, which only needs the source to be
+     read. A run that finishes cleanly deletes the file. A file changed in
+     place doesn't change any stamp so the checkpoint is only meant for
+     picking up an interrupted run, not for skipping work in general. ***/
+#include "globals.h"
+
+#define CKP_FLUSH_SECS 5
+#define CKP_SRC        "src:"
+#define CKP_DEST       "dest:"
+
+bool treeCkpLoad(void);
+bool treeCkpLine(char *line, string &rel_path, st_dir_stamp &stamp);
+void treeCkpStamp(struct stat *st, st_dir_stamp &stamp);
+bool treeCkpSubDirsDone(const string &rel_path);
+void treeCkpFlush(void);
+
+
+/*** Load any checkpoint left by a previous run of the same sync and open it
+     for adding to ***/
+void treeCkpStart(void)
+{
+	const char *path = job->checkpoint_path.c_str();
+	bool resume = treeCkpLoad();
+
+	if (resume)
+	{
+		if (job->verbose)
+		{
+			logPrintf("Resuming from checkpoint \"%s\": %lu directories done.\n",
+				path,job->ckp_done.size());
+		}
+		job->ckp_fp = fopen(path,"a");
+	}
+	else if ((job->ckp_fp = fopen(path,"w")))
+	{
+		fprintf(job->ckp_fp,"%s%s\n%s%s\n",
+			CKP_SRC,job->dir_src.c_str(),CKP_DEST,job->dir_dest.c_str());
+	}
+	if (!job->ckp_fp)
+	{
+		logPrintf("WARNING: treeCkpStart(): fopen(\"%s\"): %s\n",
+			path,strerror(errno));
+		++job->warnings;
+	}
+	job->ckp_flushed = time(0);
+}
+
+
+
+
+/*** Returns true if there's a usable checkpoint for this source and
+     destination. A partly written last line is ignored. ***/
+bool treeCkpLoad(void)
+{
+	FILE *fp;
+	char line[PATH_MAX+100];
+	string rel_path;
+	st_dir_stamp stamp;
+	int num;
+
+	if (!(fp = fopen(job->checkpoint_path.c_str(),"r"))) return false;
+
+	for(num=0;fgets(line,sizeof(line),fp);++num)
+	{
+		if (line[strlen(line)-1] != '\n') break;
+		line[strlen(line)-1] = 0;
+
+		switch(num)
+		{
+		case 0:
+			if (strncmp(line,CKP_SRC,strlen(CKP_SRC)) ||
+			    job->dir_src != line + strlen(CKP_SRC)) goto MISMATCH;
+			continue;
+		case 1:
+			if (strncmp(line,CKP_DEST,strlen(CKP_DEST)) ||
+			    job->dir_dest != line + strlen(CKP_DEST)) goto MISMATCH;
+			continue;
+		}
+		if (treeCkpLine(line,rel_path,stamp)) job->ckp_done[rel_path] = stamp;
+	}
+	fclose(fp);
+	return num > 1;
+
+	MISMATCH:
+	if (job->verbose)
+	{
+		logPrintf("Checkpoint \"%s\" is for a different sync, starting again.\n",
+			job->checkpoint_path.c_str());
+	}
+	fclose(fp);
+	job->ckp_done.clear();
+	return false;
+}
+
+
+
+
+bool treeCkpLine(char *line, string &rel_path, st_dir_stamp &stamp)
+{
+	unsigned long ino;
+	long mtime;
+	long mtime_ns;
+	long ctime;
+	long ctime_ns;
+	int len;
+
+	if (sscanf(line,"%lu %ld %ld %ld %ld %n",
+		&ino,&mtime,&mtime_ns,&ctime,&ctime_ns,&len) != 5 ||
+	    !line[len])
+	{
+		return false;
+	}
+	stamp.ino = ino;
+	stamp.mtime = mtime;
+	stamp.mtime_ns = mtime_ns;
+	stamp.ctime = ctime;
+	stamp.ctime_ns = ctime_ns;
+	rel_path = line + len;
+	return true;
+}
+
+
+
+
+void treeCkpStamp(struct stat *st, st_dir_stamp &stamp)
+{
+	stamp.ino = st->st_ino;
+#ifdef __APPLE__
+	stamp.mtime = st->st_mtimespec.tv_sec;
+	stamp.mtime_ns = st->st_mtimespec.tv_nsec;
+	stamp.ctime = st->st_ctimespec.tv_sec;
+	stamp.ctime_ns = st->st_ctimespec.tv_nsec;
+#else
+	stamp.mtime = st->st_mtim.tv_sec;
+	stamp.mtime_ns = st->st_mtim.tv_nsec;
+	stamp.ctime = st->st_ctim.tv_sec;
+	stamp.ctime_ns = st->st_ctim.tv_nsec;
+#endif
+}
+
+
+
+
+/*** Returns true if the directory and everything under it was finished by
+     a previous run and hasn't changed since ***/
+bool treeCkpDone(const string &rel_path, struct stat *src_stat)
+{
+	st_dir_stamp stamp;
+
+	if (!job->ckp_done.size()) return false;
+
+	auto it = job->ckp_done.find(rel_path);
+	if (it == job->ckp_done.end()) return false;
+
+	treeCkpStamp(src_stat,stamp);
+	return stamp == it->second && treeCkpSubDirsDone(rel_path);
+}
+
+
+
+
+/*** Every sub directory that would be descended into must have been done
+     and be unchanged too ***/
+bool treeCkpSubDirsDone(const string &rel_path)
+{
+	map<string,struct stat> src_files;
+	string src_dir = job->dir_src + rel_path;
+	string sub_path;
+
+	if (!loadDir(src_dir,src_files)) return false;
+
+	for(auto &[name,src_stat]: src_files)
+	{
+		if (job->stopped) return false;
+		if (!S_ISDIR(src_stat.st_mode)) continue;
+
+		sub_path = rel_path + "/" + name;
+		if (job->dir_rules.size() && dirExcluded(name,sub_path)) continue;
+		if (!treeCkpDone(sub_path,&src_stat)) return false;
+	}
+	return true;
+}
+
+
+
+
+/*** Record a finished directory. Names with newlines can't go in the file
+     so they'll just be done again. ***/
+void treeCkpSave(const string &rel_path, struct stat *src_stat)
+{
+	st_dir_stamp stamp;
+
+	if (!job->ckp_fp || rel_path.find('\n') != string::npos) return;
+
+	treeCkpStamp(src_stat,stamp);
+	fprintf(job->ckp_fp,"%lu %ld %ld %ld %ld %s\n",
+		(unsigned long)stamp.ino,
+		(long)stamp.mtime,stamp.mtime_ns,
+		(long)stamp.ctime,stamp.ctime_ns,rel_path.c_str());
+
+	if (time(0) - job->ckp_flushed >= CKP_FLUSH_SECS) treeCkpFlush();
+}
+
+
+
+
+void treeCkpFlush(void)
+{
+	if (fflush(job->ckp_fp) == EOF || fdatasync(fileno(job->ckp_fp)) == -1)
+	{
+		logPrintf("WARNING: treeCkpFlush(): \"%s\": %s\n",
+			job->checkpoint_path.c_str(),strerror(errno));
+		++job->warnings;
+	}
+	job->ckp_flushed = time(0);
+}
+
+
+
+
+/*** If the whole tree was done without errors the checkpoint isn't needed
+     any more, else make sure it's on disk for the next run ***/
+void treeCkpFinish(void)
+{
+	if (!job->ckp_fp) return;
+
+	if (job->stopped || job->errors)
+	{
+		treeCkpFlush();
+		fclose(job->ckp_fp);
+		if (job->verbose)
+		{
+			logPrintf("Checkpoint kept in \"%s\".\n",
+				job->checkpoint_path.c_str());
+		}
+	}
+	else
+	{
+		fclose(job->ckp_fp);
+		unlink(job->checkpoint_path.c_str());
+	}
+	job->ckp_fp = NULL;
+}
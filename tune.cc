@@ -0,0 +1,472 @@
+/*** Auto tuning (-a). Works out what sort of storage the source and
+     destination are on from the filesystem type and whether the disk is
+     rotational, then times reading a sample source file and writing a
+     probe file in the destination with a few different buffer sizes. From
+     that it picks the copy engine, buffer size, number of threads,
+     readahead and how to sync at the end. The choice is cached in
+     ~/.filesync_tune for each pair of devices so later runs can skip the
+     probe. Delete the file to probe again. ***/
+#include "globals.h"
+
+#include <chrono>
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/sysmacros.h>
+#else
+#include <sys/param.h>
+#include <sys/mount.h>
+#endif
+
+#define TUNE_CACHE       ".filesync_tune"
+#define TUNE_PROBE       ".filesync.tune."
+#define TUNE_BYTES       16777216
+#define TUNE_MIN_SAMPLE  1048576
+#define TUNE_MAX_THREADS 16
+
+// Filesystem magic numbers from statfs()
+#define FS_TMPFS 0x01021994
+#define FS_RAMFS 0x858458f6
+#define FS_NFS   0x6969
+#define FS_SMB   0x517b
+#define FS_CIFS  0xff534d42
+#define FS_SMB2  0xfe534d42
+#define FS_FUSE  0x65735546
+#define FS_CEPH  0x00c36400
+#define FS_9P    0x01021997
+
+enum
+{
+	KIND_MEMORY,
+	KIND_SSD,
+	KIND_DISK,
+	KIND_NETWORK
+};
+
+static const char *kind_name[] =
+{
+	"memory",
+	"ssd",
+	"disk",
+	"network"
+};
+
+struct st_side
+{
+	dev_t dev;
+	unsigned long fs_type;
+	int kind;
+};
+
+static size_t tune_sizes[] =
+{
+	65536,
+	262144,
+	1048576,
+	4194304
+};
+
+#define NUM_SIZES (int)(sizeof(tune_sizes) / sizeof(size_t))
+
+bool   tuneSide(const string &dir, st_side &side);
+int    tuneRotational(dev_t dev);
+int    tuneProbe(st_side &src, st_side &dest);
+bool   tuneSample(string &path);
+double tuneRead(int fd, char *buff, size_t size);
+double tuneWrite(const string &path, char *buff, size_t size);
+double tuneCopyRange(int src_fd, const string &path);
+string tuneCachePath(void);
+string tuneCacheKey(st_side &src, st_side &dest);
+bool   tuneLoad(st_side &src, st_side &dest, int &threads);
+void   tuneSave(st_side &src, st_side &dest, int threads);
+void   tuneReport(st_side &src, st_side &dest, bool cached);
+
+
+/*** Pick the settings for this job ***/
+void tuneStart(void)
+{
+	st_side src;
+	st_side dest;
+	bool cached;
+	int threads;
+
+	if (!tuneSide(job->dir_src,src) || !tuneSide(job->dir_dest,dest))
+		return;
+
+	if (!(cached = tuneLoad(src,dest,threads)))
+	{
+		threads = tuneProbe(src,dest);
+		tuneSave(src,dest,threads);
+	}
+	// -w wins
+	if (!job->threads) job->threads = threads;
+
+	// Only worth it if there's a disk arm to move
+	if (src.kind == KIND_DISK) job->flags.layout_order = 1;
+	tuneReport(src,dest,cached);
+}
+
+
+
+
+bool tuneSide(const string &dir, st_side &side)
+{
+	struct statfs sfs;
+	struct stat fs;
+
+	if (stat(dir.c_str(),&fs) == -1 || statfs(dir.c_str(),&sfs) == -1)
+	{
+		logPrintf("WARNING: tuneSide(): \"%s\": %s\n",
+			dir.c_str(),strerror(errno));
+		++job->warnings;
+		return false;
+	}
+	side.dev = fs.st_dev;
+	side.fs_type = (unsigned long)sfs.f_type;
+
+	switch(side.fs_type)
+	{
+	case FS_TMPFS:
+	case FS_RAMFS:
+		side.kind = KIND_MEMORY;
+		break;
+	case FS_NFS:
+	case FS_SMB:
+	case FS_CIFS:
+	case FS_SMB2:
+	case FS_FUSE:
+	case FS_CEPH:
+	case FS_9P:
+		side.kind = KIND_NETWORK;
+		break;
+	default:
+		side.kind = (tuneRotational(side.dev) == 1 ? KIND_DISK : KIND_SSD);
+	}
+	return true;
+}
+
+
+
+
+/*** Returns 1 if the block device is rotational, 0 if not and -1 if we
+     can't tell, eg it's not a block device. Partitions don't have a queue
+     directory of their own so look at the parent disk. ***/
+int tuneRotational(dev_t dev)
+{
+#ifdef __linux__
+	FILE *fp;
+	char path[100];
+	int rot;
+
+	snprintf(path,sizeof(path),
+		"/sys/dev/block/%u:%u/queue/rotational",major(dev),minor(dev));
+	if (!(fp = fopen(path,"r")))
+	{
+		snprintf(path,sizeof(path),
+			"/sys/dev/block/%u:%u/../queue/rotational",
+			major(dev),minor(dev));
+		if (!(fp = fopen(path,"r"))) return -1;
+	}
+	if (fscanf(fp,"%d",&rot) != 1) rot = -1;
+	fclose(fp);
+	return rot;
+#else
+	(void)dev;
+	return -1;
+#endif
+}
+
+
+
+
+/*** Time each buffer size reading the sample and writing the probe and
+     take the fastest, only going up a size if it's clearly better. Then see
+     if copy_file_range() is as quick. The rest comes from the kinds.
+     Returns the number of threads to use. ***/
+int tuneProbe(st_side &src, st_side &dest)
+{
+	vector<char> data(tune_sizes[NUM_SIZES-1]);
+	string probe_path;
+	string sample_path;
+	double secs[NUM_SIZES];
+	double best_secs;
+	double range_secs;
+	int src_fd = -1;
+	int threads;
+	int best;
+	int i;
+
+	// Random data so compressing or deduping filesystems don't cheat
+	for(auto &c: data) c = (char)random();
+
+	probe_path = job->dir_dest + "/" + TUNE_PROBE + to_string(getpid());
+	if (tuneSample(sample_path))
+		src_fd = open(sample_path.c_str(),O_RDONLY);
+
+	for(i=0;i < NUM_SIZES;++i)
+	{
+		secs[i] = tuneWrite(probe_path,data.data(),tune_sizes[i]);
+		if (src_fd != -1)
+			secs[i] += tuneRead(src_fd,data.data(),tune_sizes[i]);
+	}
+	for(i=1,best=0;i < NUM_SIZES;++i)
+		if (secs[i] > 0 && secs[i] < secs[best] * 0.95) best = i;
+	best_secs = secs[best];
+	job->buff_size = tune_sizes[best];
+
+	job->copy_engine = ENGINE_RW;
+	if (src_fd != -1)
+	{
+		range_secs = tuneCopyRange(src_fd,probe_path);
+		if (range_secs > 0 && range_secs <= best_secs * 1.1)
+			job->copy_engine = ENGINE_COPY_RANGE;
+		close(src_fd);
+	}
+
+	// Spinning disks don't like being pulled in different directions,
+	// network filesystems hide latency with lots of requests in flight
+	if (src.kind == KIND_DISK || dest.kind == KIND_DISK)
+		threads = 1;
+	else if (src.kind == KIND_NETWORK || dest.kind == KIND_NETWORK)
+		threads = TUNE_MAX_THREADS;
+	else
+	{
+		threads = min((int)thread::hardware_concurrency(),TUNE_MAX_THREADS);
+		if (threads < 1) threads = DEFAULT_THREADS;
+	}
+	job->flags.readahead = (src.kind == KIND_DISK || src.kind == KIND_NETWORK);
+
+	// No point syncing memory and no need to sync anything else
+	job->sync_mode = (dest.kind == KIND_MEMORY ? SYNC_NONE : SYNC_FS);
+	return threads;
+}
+
+
+
+
+/*** Use the biggest regular file in the top source directory if it's big
+     enough to tell anything ***/
+bool tuneSample(string &path)
+{
+	map<string,struct stat> files;
+	off_t size = 0;
+
+	if (!loadDir(job->dir_src,files)) return false;
+	for(auto &[name,st]: files)
+	{
+		if ((st.st_mode & S_IFMT) == S_IFREG && st.st_size > size)
+		{
+			size = st.st_size;
+			path = job->dir_src + "/" + name;
+		}
+	}
+	return size >= TUNE_MIN_SAMPLE;
+}
+
+
+
+
+/*** Returns the time taken to read up to TUNE_BYTES. Dropping the cached
+     pages first means we see the device, not memory. ***/
+double tuneRead(int fd, char *buff, size_t size)
+{
+	auto start = chrono::steady_clock::now();
+	size_t total;
+	ssize_t len;
+
+#ifdef __linux__
+	posix_fadvise(fd,0,0,POSIX_FADV_DONTNEED);
+#endif
+	lseek(fd,0,SEEK_SET);
+	for(total=0;total < TUNE_BYTES;total += len)
+		if ((len = read(fd,buff,size)) <= 0) break;
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+
+
+/*** Returns the time taken to write TUNE_BYTES and get it on disk or -1 if
+     the probe file can't be written ***/
+double tuneWrite(const string &path, char *buff, size_t size)
+{
+	auto start = chrono::steady_clock::now();
+	size_t total;
+	int fd;
+
+	if ((fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600)) == -1)
+		return -1;
+	for(total=0;total < TUNE_BYTES;total += size)
+	{
+		if (write(fd,buff,size) != (ssize_t)size)
+		{
+			close(fd);
+			unlink(path.c_str());
+			return -1;
+		}
+	}
+	fdatasync(fd);
+	close(fd);
+	unlink(path.c_str());
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+
+
+
+/*** Returns the time to copy the sample to the probe file with
+     copy_file_range() or -1 if it can't be used between them ***/
+double tuneCopyRange(int src_fd, const string &path)
+{
+#ifdef __linux__
+	auto start = chrono::steady_clock::now();
+	loff_t offset;
+	ssize_t len;
+	int fd;
+
+	if ((fd = open(path.c_str(),O_WRONLY | O_CREAT | O_TRUNC,0600)) == -1)
+		return -1;
+
+	// Use our own offset as the reads have left src_fd at the end
+	posix_fadvise(src_fd,0,0,POSIX_FADV_DONTNEED);
+	for(offset=0;offset < TUNE_BYTES;)
+	{
+		if ((len = copy_file_range(
+			src_fd,&offset,fd,NULL,TUNE_BYTES - offset,0)) <= 0) break;
+	}
+	fdatasync(fd);
+	close(fd);
+	unlink(path.c_str());
+	if (!offset) return -1;
+
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+#else
+	(void)src_fd;
+	(void)path;
+	return -1;
+#endif
+}
+
+
+
+
+string tuneCachePath(void)
+{
+	const char *home = getenv("HOME");
+	return home ? string(home) + "/" + TUNE_CACHE : "";
+}
+
+
+
+
+string tuneCacheKey(st_side &src, st_side &dest)
+{
+	char key[100];
+
+	snprintf(key,sizeof(key),"%lu %lu %lx %lx",
+		(unsigned long)src.dev,(unsigned long)dest.dev,
+		src.fs_type,dest.fs_type);
+	return key;
+}
+
+
+
+
+/*** Returns true if there's a cached choice for these devices. Each line is
+     the key then engine, buffer size, threads, readahead and sync mode.
+     Anything out of range means the file's been damaged. ***/
+bool tuneLoad(st_side &src, st_side &dest, int &threads)
+{
+	FILE *fp;
+	string path = tuneCachePath();
+	string key = tuneCacheKey(src,dest);
+	char line[200];
+	unsigned long buff_size;
+	int engine;
+	int readahead;
+	int sync_mode;
+
+	if (path == "" || !(fp = fopen(path.c_str(),"r"))) return false;
+
+	while(fgets(line,sizeof(line),fp))
+	{
+		if (strncmp(line,key.c_str(),key.size()) || line[key.size()] != ' ')
+			continue;
+		if (sscanf(line + key.size(),"%d %lu %d %d %d",
+			&engine,&buff_size,&threads,&readahead,&sync_mode) != 5 ||
+		    engine < ENGINE_RW || engine > ENGINE_COPY_RANGE ||
+		    !buff_size || buff_size > tune_sizes[NUM_SIZES-1] ||
+		    threads < 1 || threads > TUNE_MAX_THREADS ||
+		    sync_mode < SYNC_ALL || sync_mode > SYNC_NONE)
+		{
+			// Corrupt so probe again
+			break;
+		}
+		fclose(fp);
+
+		job->copy_engine = engine;
+		job->buff_size = buff_size;
+		job->flags.readahead = !!readahead;
+		job->sync_mode = sync_mode;
+		return true;
+	}
+	fclose(fp);
+	return false;
+}
+
+
+
+
+/*** Replace any old entry for these devices via a temporary file so runs
+     at the same time don't see a partial cache ***/
+void tuneSave(st_side &src, st_side &dest, int threads)
+{
+	FILE *in;
+	FILE *out;
+	string path = tuneCachePath();
+	string tmp_path;
+	string key = tuneCacheKey(src,dest);
+	char line[200];
+
+	if (path == "") return;
+	tmp_path = path + "." + to_string(getpid()) + "." +
+	           to_string(hash<thread::id>()(this_thread::get_id()) & 0xffff);
+	if (!(out = fopen(tmp_path.c_str(),"w"))) return;
+
+	if ((in = fopen(path.c_str(),"r")))
+	{
+		while(fgets(line,sizeof(line),in))
+		{
+			if (strncmp(line,key.c_str(),key.size()) ||
+			    line[key.size()] != ' ') fputs(line,out);
+		}
+		fclose(in);
+	}
+	fprintf(out,"%s %d %lu %d %d %d\n",
+		key.c_str(),
+		job->copy_engine,
+		(unsigned long)job->buff_size,
+		threads,job->flags.readahead,job->sync_mode);
+
+	if (fclose(out) == EOF || rename(tmp_path.c_str(),path.c_str()) == -1)
+		unlink(tmp_path.c_str());
+}
+
+
+
+
+void tuneReport(st_side &src, st_side &dest, bool cached)
+{
+	const char *sync_name[] = { "all", "destination", "none" };
+
+	if (!job->verbose) return;
+	logPrintf("Tuning: source is %s, destination is %s%s.\n",
+		kind_name[src.kind],kind_name[dest.kind],cached ? " (cached)" : "");
+	logPrintf("Tuning: engine %s, buffer %s, threads %d, readahead %s, layout order %s, sync %s.\n",
+		job->copy_engine == ENGINE_COPY_RANGE ? "copy_file_range" : "read/write",
+		bytesSizeStr(job->buff_size),
+		job->threads,
+		job->flags.readahead ? "on" : "off",
+		job->flags.layout_order ? "on" : "off",sync_name[job->sync_mode]);
+}